@@ -11,7 +11,11 @@
 #ifndef _PARSER_H_
 #define _PARSER_H_
 
+#include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define MAX_ARGS 10
 
@@ -22,6 +26,7 @@ typedef enum {
     TOKEN_ID,
     TOKEN_DOLLAR,
     TOKEN_STRING,
+    TOKEN_ARITH,            /* $(( expression )) */
 
     TOKEN_IF     = 20,
     TOKEN_THEN,
@@ -46,13 +51,29 @@ typedef enum {
     TOKEN_TICK,
     TOKEN_PIPE,
     TOKEN_NEWLINE,
+    TOKEN_APPEND,           /* >> */
+    TOKEN_DUP,              /* >& or <& */
 
     TOKEN_ERROR = 100,
 } Token_Type_t;
 
+/* Region allocator, everything from a parse is given back in one go */
+typedef struct Arena_Chunk Arena_Chunk_t;
+
+typedef struct {
+    Arena_Chunk_t *head;
+    Arena_Chunk_t *cur;
+} Arena_t;
+
+typedef struct {
+    Arena_Chunk_t *chunk;
+    size_t         used;
+} Arena_Mark_t;
+
 typedef struct {
     Token_Type_t type;
     char        *str;
+    int          len;
     bool         control;
 
     int linenum;
@@ -66,87 +87,300 @@ typedef struct Parser {
     /* Scanner Context */
     char c;
     char *LineChar;
-    char line[1024];
-
-    int  token_startline;
-    int  token_startcol;
-    char token[1024];
-    int  token_idx;
+    FILE *file;
+    char line[1024];    /* Lookahead window, unread chars are [line_head, line_tail) */
+    char  *input;       /* Window base, either line or the mapped script */
+    size_t input_len;   /* Length of the mapped script */
+    size_t line_head;
+    size_t line_tail;
+    bool   line_eof;
+
+    int    token_startline;
+    int    token_startcol;
+    char   token[1024];
+    int    token_idx;
+    bool   token_slice;     /* Token is still input[token_start, token_idx) */
+    size_t token_start;
+    size_t token_clobbered; /* Terminator written over by the last slice */
     int  (*getchar)(struct Parser *parser, int timeout);
 
     /* Parser Context */
     Token_t *t;
     bool token_control;
+    Arena_t *arena;     /* Owns the tokens and AST built by the parse */
+    struct AST_Program *program;
 } Parser_t;
 
-/* Abstract Syntax Tree */
-struct AST_Pipeline;
-struct AST_List;
+/* Abstract Syntax Tree
+ *
+ * All the nodes of a program sit in one array and refer to each other by
+ * index. Index 0 is never handed out, so AST_NONE marks a missing child. */
+typedef uint32_t AST_Index_t;
 
-typedef struct {
-    Token_t *file;
-} AST_Redirect_t;
+#define AST_NONE ((AST_Index_t) 0)
 
-typedef struct {
-    int   argc;
-    Token_t **argv;
+typedef enum {
+    AST_LIST,
+    AST_ASSIGNMENT,
+    AST_EXPRESSION,
+    AST_COMMAND,
+    AST_IF,
+    AST_FOR,
+    AST_WHILE,
+    AST_PIPE,
+} AST_Kind_t;
+
+/* Bounded single producer, single consumer byte stream between the stages
+ * of a pipeline that run in the shell */
+typedef struct Ring Ring_t;
+
+/* Buffered output, written out when full, after each command on a terminal,
+ * at the end of a program and before anything else writes to the fd */
+typedef struct Sink {
+    int     fd;                 /* -1 collects everything in buf */
+    Ring_t *ring;               /* Or flushed into the next stage of a pipeline */
+    bool    tty;
+    char   *buf;
+    size_t  len;
+    size_t  size;
+} Sink_t;
+
+#define SINK_SIZE       (64*1024)
+#define SINK_SIZE_MIN   256
+
+/* Where a builtin reads its input from */
+typedef struct Source {
+    int     fd;
+    Ring_t *ring;               /* The previous stage of a pipeline, fd unused */
+} Source_t;
+
+#define RING_SIZE       (256*1024)
+
+/* The command cache and background jobs, one of each per shell */
+typedef struct Path_Cache Path_Cache_t;
+typedef struct Job_Table  Job_Table_t;
+
+/* Everything one interpreter needs, see Shell Functions */
+typedef struct Shell_Context Shell_Context_t;
+
+/* Tasks are numbered from here, above any pid, so wait can tell them apart */
+#define TASK_ID_BASE    (1 << 22)
+
+/* Builtin commands run inside the shell */
+typedef int (*Builtin_Func_t)(Sink_t *out, Source_t *in, int argc, char *const argv[]);
 
-    bool background;
-    AST_Redirect_t *in;
-    AST_Redirect_t *out;
+typedef struct {
+    uint32_t        argv;       /* First argument in program->words */
+    uint32_t        argc;
+    uint32_t        redirects;  /* First redirection in program->redirects */
+    uint32_t        nredirects;
+    bool            background;
+    Builtin_Func_t  builtin;    /* Bound when compiled if the name is known */
+    char          **args;       /* Literal arguments, NULL where a $var goes */
+    bool            dynamic;    /* Some of args are filled in at run time */
+    int            *slots;      /* Variable slot of each $var, -1 otherwise */
+    AST_Index_t    *ariths;     /* Tree of each $(( )), AST_NONE otherwise */
 } AST_Command_t;
 
+/* Applied in order, so 2>&1 > file leaves 2 where 1 was */
 typedef struct {
-    Token_t *var;
-} AST_Variable_t;
+    Token_Type_t  type;         /* <, >, >> or a dup */
+    int           fd;           /* The fd being replaced */
+    Token_t      *target;       /* File name, or the fd to copy for a dup */
+    int           slot;         /* Variable slot when the target is a $var */
+} AST_Redirect_t;
 
 typedef struct {
-    Token_t *var;
-    Token_t *value;
+    Token_t     *var;
+    Token_t     *value;
+    int          slot;          /* Variable slot of var, bound when compiled */
+    int          source;        /* Slot of the value when it is a $var, or -1 */
+    AST_Index_t  arith;         /* Compiled value when it is a $(( )) */
 } AST_Assignment_t;
 
-typedef struct AST_Expression {
-    AST_Command_t         *command;
-    Token_t               *op;
-    struct AST_Expression *expression;
-} AST_Expression_t;
+typedef enum {
+    ARITH_NUM,
+    ARITH_VAR,
+    ARITH_NEG,
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_LT,
+    ARITH_LE,
+    ARITH_GT,
+    ARITH_GE,
+    ARITH_EQ,
+    ARITH_NE,
+} AST_Arith_Op_t;
+
+/* Arithmetic nodes have their own array, indexed like the AST */
+typedef struct {
+    AST_Arith_Op_t op;
+    AST_Index_t    left;
+    AST_Index_t    right;
+    union {
+        long       num;
+        int        slot;
+    };
+} AST_Arith_t;
 
 typedef struct {
-    struct AST_List      *test;
-    struct AST_Pipeline *pipeline;
-    struct AST_Pipeline *elsepipeline;
-} AST_IfPipeline_t;;
+    AST_Index_t  command;
+    Token_Type_t op;            /* && or || before the next expression */
+    AST_Index_t  expression;
+} AST_Expression_t;
 
-typedef struct AST_Words {
-    Token_t **words;
-    int       nwords;
-} AST_Words_t;
+typedef struct {
+    AST_Index_t test;
+    AST_Index_t list;
+    AST_Index_t elselist;
+} AST_IfPipeline_t;
 
 typedef struct {
-    Token_t         *var;
-    AST_Words_t     *words;
-    struct AST_List *list;
+    Token_t    *var;
+    int         slot;           /* Variable slot of var, bound when compiled */
+    uint32_t    words;          /* First word in program->words */
+    uint32_t    nwords;
+    AST_Index_t list;
+    bool        parallel;       /* for -P N, iterations run at once */
+    uint32_t    workers;        /* N, 0 for one per processor */
 } AST_ForPipeline_t;
 
 typedef struct {
-    struct AST_List   *test;
-    struct AST_List   *list;
+    AST_Index_t test;
+    AST_Index_t list;
 } AST_WhilePipeline_t;
 
-typedef struct AST_Pipeline {
-    AST_Assignment_t     *assignment;
-    AST_Expression_t     *expression;
-    AST_IfPipeline_t    *ifpipeline;
-    AST_ForPipeline_t   *forpipeline;
-    AST_WhilePipeline_t *whilepipeline;
-    struct AST_Pipeline *tickpipeline;
-} AST_Pipeline_t;
-
-typedef struct AST_List {
-    AST_Pipeline_t  **pipelines;
-    int npipelines;
+/* a | b | c, the commands are chained through next */
+typedef struct {
+    AST_Index_t first;
+    uint32_t    ncommands;
+    uint32_t    nargs;          /* Sum of argc, set when compiled */
+} AST_Pipe_t;
+
+typedef struct {
+    AST_Index_t first;          /* Pipelines are chained through next */
+    uint32_t    npipelines;
 } AST_List_t;
 
+typedef struct {
+    AST_Kind_t  kind;
+    AST_Index_t next;           /* Following pipeline in the same list */
+    bool        background;     /* A compound command run as a task with & */
+    union {
+        AST_List_t          list;
+        AST_Assignment_t    assignment;
+        AST_Expression_t    expression;
+        AST_Command_t       command;
+        AST_IfPipeline_t    ifpipeline;
+        AST_ForPipeline_t   forpipeline;
+        AST_WhilePipeline_t whilepipeline;
+        AST_Pipe_t          pipe;
+    };
+} AST_Node_t;
+
+/* Bytecode the program is compiled to before it is run */
+typedef enum {
+    OP_HALT,
+    OP_STATUS,          /* status = a */
+    OP_ASSIGN,          /* Run assignment node a */
+    OP_COMMAND,         /* Run command node a */
+    OP_JUMP,            /* pc = a */
+    OP_JUMP_TRUE,       /* pc = a when status is zero */
+    OP_JUMP_FALSE,      /* pc = a when status is non zero */
+    OP_FOR_BEGIN,       /* Start for node a in loop slot c */
+    OP_FOR_NEXT,        /* Set the next word of for node a, or pc = b when done */
+    OP_FOR_PARALLEL,    /* Run for node a's body up to OP_HALT for every word, pc = b */
+    OP_TEST,            /* Evaluate test a, a compiled [ ... ] */
+    OP_PIPE,            /* Run pipe node a */
+    OP_SPAWN,           /* Run to the OP_HALT before a as task $! in slot b, pc = a */
+} VM_Opcode_t;
+
+typedef struct {
+    uint16_t op;
+    uint16_t c;
+    uint32_t a;
+    uint32_t b;
+} VM_Op_t;
+
+/* A word of a compiled [ ... ] */
+typedef struct {
+    int          slot;          /* Variable slot, or -1 */
+    AST_Index_t  arith;         /* $(( )) tree, or AST_NONE */
+    const char  *str;           /* Literal text when neither of the above */
+    long         num;           /* The literal as an integer */
+    bool         nan;           /* The literal is not one */
+} Test_Operand_t;
+
+typedef enum {
+    TEST_STRING,                /* s, -n s */
+    TEST_EMPTY,                 /* -z s */
+    TEST_STREQ,
+    TEST_STRNE,
+    TEST_EQ,
+    TEST_NE,
+    TEST_LT,
+    TEST_LE,
+    TEST_GT,
+    TEST_GE,
+    TEST_NOT,
+    TEST_AND,
+    TEST_OR,
+    TEST_EXISTS,                /* -e */
+    TEST_FILE,                  /* -f */
+    TEST_DIR,                   /* -d */
+    TEST_SYMLINK,               /* -h, -L */
+    TEST_READ,                  /* -r */
+    TEST_WRITE,                 /* -w */
+    TEST_EXEC,                  /* -x */
+    TEST_SIZE,                  /* -s */
+} Test_Op_t;
+
+/* Leaves refer to operands, ! -a and -o to other tests */
+typedef struct {
+    Test_Op_t op;
+    uint32_t  left;
+    uint32_t  right;
+} Test_Node_t;
+
+typedef struct AST_Program {
+    AST_Node_t     *nodes;
+    uint32_t        nnodes;
+    Token_t       **words;      /* Command arguments and for loop words */
+    uint32_t        nwords;
+    AST_Index_t     list;
+    Arena_t        *arena;
+
+    VM_Op_t        *code;
+    uint32_t        ncode;
+    Test_Node_t    *tests;      /* [ ... ] commands, built when compiled */
+    uint32_t        ntests;
+    Test_Operand_t *operands;
+    uint32_t        noperands;
+    AST_Arith_t    *ariths;     /* $(( )) trees, built when compiled */
+    uint32_t        nariths;
+    AST_Redirect_t *redirects;
+    uint32_t        nredirects;
+    uint32_t        nloops;     /* Deepest nesting of for loops */
+    uint32_t        refs;       /* Loops still running it in the background */
+    bool            detached;   /* Owns its arena, see AST_DetachProgram */
+    uint32_t        maxargc;    /* Longest argv any command needs */
+    int             status;     /* Variable slot of $? */
+} AST_Program_t;
+
+#define AST_NODE(program, index) (&((program)->nodes[index]))
+
+/* A command of a pipeline with its arguments filled in, ready to run */
+typedef struct {
+    Builtin_Func_t  builtin;
+    int             argc;
+    char          **argv;
+    AST_Program_t  *program;
+    AST_Command_t  *command;    /* For its redirections */
+} Shell_Stage_t;
+
 #define STRING_ESC_CHAR '\\'
 
 enum {
@@ -155,21 +389,114 @@ enum {
 };
 
 
+/* Arena Functions */
+void *Arena_Alloc(Arena_t *arena, size_t size);
+void *Arena_Realloc(Arena_t *arena, void *p, size_t oldsize, size_t size);
+void *Arena_Grow(Arena_t *arena, void *array, size_t n, size_t size);
+char *Arena_Strndup(Arena_t *arena, const char *s, size_t len);
+Arena_Mark_t Arena_Mark(Arena_t *arena);
+void Arena_Release(Arena_t *arena, Arena_Mark_t mark);
+void Arena_Reset(Arena_t *arena);
+void Arena_Free(Arena_t *arena);
+
 /* Scanner Functions */
+void Scanner_Start(Parser_t *parser);
 Token_t *Scanner_TokenNext(Parser_t *parser);
 void Scanner_TokenConsume(Parser_t *parser);
 void Scanner_TokenAccept(Parser_t *parser);
-void Scanner_TokenFree(Token_t *t);
 
 /* AST Functions */
-AST_List_t *AST_ParseProgram(Parser_t *parser);
-void AST_PrintList(AST_List_t *pipeline_list);
-int  AST_ProcessList(AST_List_t *pipeline_list);
-void AST_FreeList(AST_List_t *pipeline_list);
-
-#define AST_PrintProgram   AST_PrintList
-#define AST_ProcessProgram AST_ProcessList
-#define AST_FreeProgram    AST_FreeList
+AST_Program_t *AST_ParseProgram(Parser_t *parser);
+void AST_PrintProgram(AST_Program_t *program);
+int  AST_ProcessProgram(AST_Program_t *program);
+int  AST_DetachProgram(AST_Program_t *program);
+void AST_FreeProgram(AST_Program_t *program);
+
+void AST_PrintList(AST_Program_t *program, AST_Index_t list);
+int  AST_ProcessAssignment(AST_Program_t *program, AST_Assignment_t *assignment);
+int  AST_ProcessCommand(AST_Program_t *program, AST_Command_t *command, char **argv);
+int  AST_ProcessPipe(AST_Program_t *program, AST_Pipe_t *pipe);
+int  AST_ApplyRedirects(AST_Program_t *program, AST_Command_t *command, int *saved);
+void AST_RestoreRedirects(AST_Program_t *program, AST_Command_t *command, int *saved, uint32_t n);
+
+/* Arithmetic Functions */
+AST_Index_t Arith_Parse(AST_Program_t *program, const char *expr);
+int Arith_Eval(AST_Program_t *program, AST_Index_t arith, long *result);
+
+/* Test Functions */
+int Test_Compile(AST_Program_t *program, AST_Command_t *command);
+int  Test_Eval(AST_Program_t *program, uint32_t test);
+
+/* Sink Functions */
+int  Sink_Init(Sink_t *sink, int fd);
+int  Sink_InitRing(Sink_t *sink, Ring_t *ring);
+void Sink_Free(Sink_t *sink);
+int  Sink_Flush(Sink_t *sink);
+int  Sink_Reserve(Sink_t *sink, size_t n);
+int  Sink_Write(Sink_t *sink, const void *data, size_t n);
+int  Sink_Puts(Sink_t *sink, const char *s);
+int  Sink_Printf(Sink_t *sink, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Ring Functions */
+Ring_t *Ring_New(void);
+void Ring_Free(Ring_t *ring);
+int  Ring_Write(Ring_t *ring, const void *data, size_t n);
+ssize_t Ring_Read(Ring_t *ring, void *buf, size_t n);
+void Ring_CloseWrite(Ring_t *ring);
+void Ring_CloseRead(Ring_t *ring);
+ssize_t Source_Read(Source_t *in, void *buf, size_t n);
+
+/* Path Functions */
+Path_Cache_t *Path_New(void);
+const char *Path_Lookup(Path_Cache_t *cache, const char *name);
+const char *Path_Resolve(const char *dirs, const char *name, char *buf, size_t size);
+void Path_Flush(Path_Cache_t *cache);
+void Path_Free(Path_Cache_t *cache);
+int  Path_Print(Path_Cache_t *cache, Sink_t *out);
+
+/* Job Functions */
+Job_Table_t *Job_New(Sink_t *out);
+int  Job_Status(int status);
+int  Job_Add(Job_Table_t *table, pid_t pid, int out);
+int  Job_Pidfd(pid_t pid);
+int  Job_Poll(Job_Table_t *table, int timeout);
+int  Job_Wait(Job_Table_t *table, pid_t pid);
+void Job_WaitAll(Job_Table_t *table);
+void Job_Free(Job_Table_t *table);
+
+/* Task Functions */
+void Task_Init(void);
+void Task_Local(void *(*swap)(void *local));
+int  Task_Spawn(int (*func)(void *arg), void *arg);
+void Task_Block(int fd, int64_t ns);
+void Task_Yield(void);
+int  Task_Join(int id);
+void Task_JoinAll(void);
+bool Task_Pending(void);
+void Task_Hold(void);
+void Task_Release(void);
+
+/* Pool Functions */
+int  Pool_Run(uint32_t n, uint32_t nworkers, void (*func)(void *arg, uint32_t i), void *arg);
+
+/* VM Functions */
+int VM_Compile(AST_Program_t *program);
+int VM_Run(AST_Program_t *program);
+
+/* Shell Functions
+ *
+ * For running scripts from another program. A shell is whatever one
+ * interpreter needs: its variables, output, jobs and command cache. A shell
+ * is used by one thread at a time, different shells can run on different
+ * threads at once. A shell whose output is collected leaves the process's
+ * fds alone, external commands it runs still inherit them */
+Shell_Context_t *Shell_New(int fd);
+void Shell_Free(Shell_Context_t *shell);
+int  Shell_RunFile(Shell_Context_t *shell, const char *file);
+int  Shell_RunString(Shell_Context_t *shell, const char *script);
+int  Shell_SetVar(Shell_Context_t *shell, const char *name, const char *value);
+const char *Shell_GetVar(Shell_Context_t *shell, const char *name);
+const char *Shell_Output(Shell_Context_t *shell, size_t *len);
 
 #endif /* _PARSER_H_ */
 
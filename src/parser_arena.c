@@ -0,0 +1,169 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       parser_arena.c
+//  Description:    Region allocator for tokens and the AST of a parse
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libraries/parser.h>
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+/* Offsets into data are rounded up, data itself has to start as aligned as
+ * malloc's result is for that to mean anything */
+struct Arena_Chunk {
+    struct Arena_Chunk *next;
+    size_t              size;
+    size_t              used;
+    _Alignas(max_align_t) char data[];
+};
+
+#define ARENA_CHUNK_SIZE (64*1024 - sizeof(Arena_Chunk_t))
+#define ARENA_ALIGN      (2*sizeof(void *))
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+static void *Arena_AllocAligned(Arena_t *arena, size_t size, size_t align)
+{
+    Arena_Chunk_t *chunk;
+    size_t         offset;
+
+    /* Chunks after the current one are free to be reused */
+    while ((chunk = arena->cur)) {
+        offset = (chunk->used + align - 1) & ~(align - 1);
+        if (offset + size <= chunk->size) {
+            chunk->used = offset + size;
+            return &(chunk->data[offset]);
+        }
+
+        if (chunk->next == NULL) {
+            break;
+        }
+        arena->cur = chunk->next;
+        arena->cur->used = 0;
+    }
+
+    /* Out of room, add another chunk on the end */
+    if ((chunk = malloc(sizeof(*chunk) +
+            ((size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE))) == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+    chunk->used = size;
+
+    if (arena->cur) {
+        arena->cur->next = chunk;
+    } else {
+        arena->head = chunk;
+    }
+    arena->cur = chunk;
+
+    return chunk->data;
+}
+
+void *Arena_Alloc(Arena_t *arena, size_t size)
+{
+    void *p;
+
+    if ((p = Arena_AllocAligned(arena, size, ARENA_ALIGN))) {
+        memset(p, 0, size);
+    }
+
+    return p;
+}
+
+void *Arena_Realloc(Arena_t *arena, void *p, size_t oldsize, size_t size)
+{
+    void *n;
+
+    if ((n = Arena_Alloc(arena, size)) && p) {
+        memcpy(n, p, (oldsize < size) ? oldsize : size);
+    }
+
+    return n;
+}
+
+/* Make room for one more element on the end of an array of n, arrays double
+ * in size each time the count reaches a power of two */
+void *Arena_Grow(Arena_t *arena, void *array, size_t n, size_t size)
+{
+    if (n & (n - 1)) {
+        return array;
+    }
+
+    return Arena_Realloc(arena, array, n*size, (n ? 2*n : 1)*size);
+}
+
+char *Arena_Strndup(Arena_t *arena, const char *s, size_t len)
+{
+    char *p;
+
+    if ((p = Arena_AllocAligned(arena, len + 1, 1))) {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+
+    return p;
+}
+
+Arena_Mark_t Arena_Mark(Arena_t *arena)
+{
+    Arena_Mark_t mark;
+
+    mark.chunk = arena->cur;
+    mark.used  = arena->cur ? arena->cur->used : 0;
+
+    return mark;
+}
+
+/* Give back everything allocated since the mark, keeping the memory */
+void Arena_Release(Arena_t *arena, Arena_Mark_t mark)
+{
+    if (mark.chunk) {
+        arena->cur       = mark.chunk;
+        arena->cur->used = mark.used;
+    } else {
+        Arena_Reset(arena);
+    }
+}
+
+/* Give back everything in the arena, keeping the memory for the next parse */
+void Arena_Reset(Arena_t *arena)
+{
+    arena->cur = arena->head;
+    if (arena->cur) {
+        arena->cur->used = 0;
+    }
+}
+
+void Arena_Free(Arena_t *arena)
+{
+    Arena_Chunk_t *chunk;
+    Arena_Chunk_t *next;
+
+    for (chunk = arena->head; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->head = NULL;
+    arena->cur  = NULL;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,329 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       parser_arith.c
+//  Description:    Parses and evaluates $(( )) arithmetic
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+typedef struct {
+    AST_Program_t *program;
+    const char    *s;
+} Arith_Parser_t;
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+int Shell_VarSlot(const char *name);
+long Shell_VarGetInt(int slot);
+
+static AST_Index_t Arith_ParseEquality(Arith_Parser_t *parser);
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+/* Take op if it is next, after any blanks */
+static bool Arith_Accept(Arith_Parser_t *parser, const char *op)
+{
+    size_t len = strlen(op);
+
+    while (isspace((unsigned char) *parser->s)) {
+        parser->s++;
+    }
+
+    if (strncmp(parser->s, op, len) != 0) {
+        return false;
+    }
+    parser->s += len;
+
+    return true;
+}
+
+static AST_Index_t Arith_Node(Arith_Parser_t *parser, AST_Arith_Op_t op,
+        AST_Index_t left, AST_Index_t right)
+{
+    AST_Program_t *program = parser->program;
+    AST_Arith_t   *nodes;
+    AST_Arith_t   *node;
+    AST_Index_t    arith;
+
+    if ((left == AST_NONE && op != ARITH_NUM && op != ARITH_VAR) ||
+        (right == AST_NONE && op > ARITH_NEG)) {
+        return AST_NONE;
+    }
+
+    if ((nodes = Arena_Grow(program->arena, program->ariths,
+                    program->nariths, sizeof(*nodes))) == NULL) {
+        return AST_NONE;
+    }
+    program->ariths = nodes;
+    arith = program->nariths++;
+
+    node = &(program->ariths[arith]);
+    node->op    = op;
+    node->left  = left;
+    node->right = right;
+
+    return arith;
+}
+
+/* A number, a variable with or without its $, or a bracketed expression */
+static AST_Index_t Arith_ParsePrimary(Arith_Parser_t *parser)
+{
+    AST_Index_t arith;
+    const char *name;
+    char       *end;
+    size_t      len;
+    long        num;
+    int         slot;
+    bool        bracket;
+
+    if (Arith_Accept(parser, "(")) {
+        arith = Arith_ParseEquality(parser);
+        return Arith_Accept(parser, ")") ? arith : AST_NONE;
+    }
+
+    if (isdigit((unsigned char) *parser->s)) {
+        num = strtol(parser->s, &end, 0);
+        parser->s = end;
+
+        if ((arith = Arith_Node(parser, ARITH_NUM, AST_NONE, AST_NONE)) != AST_NONE) {
+            parser->program->ariths[arith].num = num;
+        }
+        return arith;
+    }
+
+    Arith_Accept(parser, "$");
+    bracket = Arith_Accept(parser, "{");
+
+    name = parser->s;
+    if (!isalpha((unsigned char) *parser->s) && *parser->s != '_') {
+        return AST_NONE;
+    }
+    while (isalnum((unsigned char) *parser->s) || *parser->s == '_') {
+        parser->s++;
+    }
+    len = parser->s - name;
+
+    if (bracket && !Arith_Accept(parser, "}")) {
+        return AST_NONE;
+    }
+
+    /* The name is looked up once, evaluating reads the slot */
+    if ((end = Arena_Strndup(parser->program->arena, name, len)) == NULL) {
+        return AST_NONE;
+    }
+    if ((slot = Shell_VarSlot(end)) < 0) {
+        return AST_NONE;
+    }
+
+    if ((arith = Arith_Node(parser, ARITH_VAR, AST_NONE, AST_NONE)) != AST_NONE) {
+        parser->program->ariths[arith].slot = slot;
+    }
+
+    return arith;
+}
+
+static AST_Index_t Arith_ParseUnary(Arith_Parser_t *parser)
+{
+    if (Arith_Accept(parser, "-")) {
+        return Arith_Node(parser, ARITH_NEG, Arith_ParseUnary(parser), AST_NONE);
+    } else if (Arith_Accept(parser, "+")) {
+        return Arith_ParseUnary(parser);
+    }
+
+    return Arith_ParsePrimary(parser);
+}
+
+static AST_Index_t Arith_ParseMultiply(Arith_Parser_t *parser)
+{
+    AST_Index_t arith = Arith_ParseUnary(parser);
+
+    while (arith != AST_NONE) {
+        if (Arith_Accept(parser, "*")) {
+            arith = Arith_Node(parser, ARITH_MUL, arith, Arith_ParseUnary(parser));
+        } else if (Arith_Accept(parser, "/")) {
+            arith = Arith_Node(parser, ARITH_DIV, arith, Arith_ParseUnary(parser));
+        } else if (Arith_Accept(parser, "%")) {
+            arith = Arith_Node(parser, ARITH_MOD, arith, Arith_ParseUnary(parser));
+        } else {
+            break;
+        }
+    }
+
+    return arith;
+}
+
+static AST_Index_t Arith_ParseAdd(Arith_Parser_t *parser)
+{
+    AST_Index_t arith = Arith_ParseMultiply(parser);
+
+    while (arith != AST_NONE) {
+        if (Arith_Accept(parser, "+")) {
+            arith = Arith_Node(parser, ARITH_ADD, arith, Arith_ParseMultiply(parser));
+        } else if (Arith_Accept(parser, "-")) {
+            arith = Arith_Node(parser, ARITH_SUB, arith, Arith_ParseMultiply(parser));
+        } else {
+            break;
+        }
+    }
+
+    return arith;
+}
+
+static AST_Index_t Arith_ParseCompare(Arith_Parser_t *parser)
+{
+    AST_Index_t arith = Arith_ParseAdd(parser);
+
+    while (arith != AST_NONE) {
+        if (Arith_Accept(parser, "<=")) {
+            arith = Arith_Node(parser, ARITH_LE, arith, Arith_ParseAdd(parser));
+        } else if (Arith_Accept(parser, ">=")) {
+            arith = Arith_Node(parser, ARITH_GE, arith, Arith_ParseAdd(parser));
+        } else if (Arith_Accept(parser, "<")) {
+            arith = Arith_Node(parser, ARITH_LT, arith, Arith_ParseAdd(parser));
+        } else if (Arith_Accept(parser, ">")) {
+            arith = Arith_Node(parser, ARITH_GT, arith, Arith_ParseAdd(parser));
+        } else {
+            break;
+        }
+    }
+
+    return arith;
+}
+
+static AST_Index_t Arith_ParseEquality(Arith_Parser_t *parser)
+{
+    AST_Index_t arith = Arith_ParseCompare(parser);
+
+    while (arith != AST_NONE) {
+        if (Arith_Accept(parser, "==")) {
+            arith = Arith_Node(parser, ARITH_EQ, arith, Arith_ParseCompare(parser));
+        } else if (Arith_Accept(parser, "!=")) {
+            arith = Arith_Node(parser, ARITH_NE, arith, Arith_ParseCompare(parser));
+        } else {
+            break;
+        }
+    }
+
+    return arith;
+}
+
+/* Build the tree for the text between $(( and )), or AST_NONE */
+AST_Index_t Arith_Parse(AST_Program_t *program, const char *expr)
+{
+    Arith_Parser_t parser;
+    AST_Index_t    arith;
+
+    DTRACE("%s: '%s'\n", __func__, expr);
+
+    parser.program = program;
+    parser.s       = expr;
+
+    /* Index 0 is never handed out, as in the AST */
+    if (program->nariths == 0) {
+        program->nariths = 1;
+    }
+
+    if ((arith = Arith_ParseEquality(&parser)) == AST_NONE) {
+        goto arith_fail;
+    }
+
+    /* Nothing but blanks may follow */
+    Arith_Accept(&parser, "");
+    if (*parser.s != '\0') {
+        goto arith_fail;
+    }
+
+    return arith;
+
+arith_fail:
+    fprintf(stderr, "ERROR: Parsing %s: '%s'\n", __func__, expr);
+
+    return AST_NONE;
+}
+
+/****************************************************************************/
+/* Sums wrap around rather than overflow, as they do in other shells */
+int Arith_Eval(AST_Program_t *program, AST_Index_t arith, long *result)
+{
+    const AST_Arith_t *node = &(program->ariths[arith]);
+    long x;
+    long y = 0;
+
+    switch (node->op) {
+        case ARITH_NUM:
+            *result = node->num;
+            return 0;
+
+        case ARITH_VAR:
+            *result = Shell_VarGetInt(node->slot);
+            return 0;
+
+        default:
+            break;
+    }
+
+    if (Arith_Eval(program, node->left, &x) < 0) {
+        return -EINVAL;
+    }
+    if (node->op != ARITH_NEG && Arith_Eval(program, node->right, &y) < 0) {
+        return -EINVAL;
+    }
+
+    switch (node->op) {
+        case ARITH_NEG: *result = -(unsigned long) x;             break;
+        case ARITH_ADD: *result = (unsigned long) x + y;          break;
+        case ARITH_SUB: *result = (unsigned long) x - y;          break;
+        case ARITH_MUL: *result = (unsigned long) x * y;          break;
+        case ARITH_LT:  *result = (x <  y);                       break;
+        case ARITH_LE:  *result = (x <= y);                       break;
+        case ARITH_GT:  *result = (x >  y);                       break;
+        case ARITH_GE:  *result = (x >= y);                       break;
+        case ARITH_EQ:  *result = (x == y);                       break;
+        case ARITH_NE:  *result = (x != y);                       break;
+
+        case ARITH_DIV:
+        case ARITH_MOD:
+            if (y == 0) {
+                fprintf(stderr, "division by zero\n");
+                return -EINVAL;
+            }
+            /* The one quotient that does not fit */
+            if (y == -1) {
+                *result = (node->op == ARITH_DIV) ? (long) -(unsigned long) x : 0;
+            } else {
+                *result = (node->op == ARITH_DIV) ? x / y : x % y;
+            }
+            break;
+
+        default:
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
@@ -11,7 +11,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <libraries/parser.h>
 
@@ -25,110 +27,161 @@
  *                              T Y P E S
  ****************************************************************************/
 
+/* Room for the text of a long */
+#define AST_NUM_SIZE (3*sizeof(long) + 2)
+
 /*****************************************************************************
  *                 F U N C T I O N     P R O T O T Y P E S
  ****************************************************************************/
-int my_setenv(char *name, char *value, int overwrite);
-char *my_getenv(char *name);
-int Shell_RunCommand(int argc, char *argv[], bool background);
-
-AST_Pipeline_t *AST_ParsePipeline(Parser_t *parser);
-AST_List_t *AST_ParseList(Parser_t *parser);
-int AST_ProcessList(AST_List_t *pipeline_list);
+char *Shell_VarGet(int slot);
+int Shell_VarSet(int slot, const char *value);
+int Shell_VarSetInt(int slot, long num);
+int Shell_RunCommand(Builtin_Func_t builtin, int argc, char *const argv[], bool background);
+int Shell_Redirect(Token_Type_t type, int fd, const char *target, int *saved);
+void Shell_RedirectRestore(int fd, int saved);
+bool Shell_Collecting(void);
+int Shell_RunPipeline(Shell_Stage_t *stages, int n);
+Builtin_Func_t Shell_BuiltinLookup(const char *name);
 
-int AST_ProcessPipeline(AST_Pipeline_t *pipeline);
+AST_Index_t AST_ParsePipeline(Parser_t *parser);
+AST_Index_t AST_ParseList(Parser_t *parser);
 
-void AST_FreeAssignment(AST_Assignment_t *assignment);
-void AST_FreeRedirect(AST_Redirect_t *redirect);
-void AST_FreeCommand(AST_Command_t *command);
-void AST_FreeExpression(AST_Expression_t *expression);
-void AST_FreeIfPipeline(AST_IfPipeline_t *ifpipeline);
-void AST_FreePipeline(AST_Pipeline_t *pipeline);
-void AST_FreeList(AST_List_t *pipeline_list);
 
 /*****************************************************************************
  *                     G L O B A L     V A R I A B L E S
  ****************************************************************************/
 
 /****************************************************************************/
-void AST_PrintAssignment(AST_Assignment_t *assignment)
+void AST_PrintAssignment(AST_Program_t *program, AST_Assignment_t *assignment)
 {
-    DTRACE("AST_Assignment: %s = %s\n", assignment->var->str, assignment->value->str);
+    DTRACE("AST_Assignment: %s = %s\n", assignment->var->str,
+            assignment->value ? assignment->value->str : "");
 }
 
-void AST_PrintCommand(AST_Command_t *command)
+void AST_PrintCommand(AST_Program_t *program, AST_Command_t *command)
 {
     int i;
 
     for (i = 0; i < command->argc; i++) {
-        DTRACE("%s ", command->argv[i]->str);
-    }
-    if (command->in) {
-        DTRACE("< %s ", command->in->file->str);
+        DTRACE("%s ", program->words[command->argv + i]->str);
     }
-    if (command->out) {
-        DTRACE("> %s ", command->out->file->str);
+    for (i = 0; i < command->nredirects; i++) {
+        DTRACE("%d:%d %s ", program->redirects[command->redirects + i].fd,
+                program->redirects[command->redirects + i].type,
+                program->redirects[command->redirects + i].target->str);
     }
     if (command->background) {
         DTRACE("&");
     }
 }
 
-void AST_PrintExpression(AST_Expression_t *expression)
+void AST_PrintExpression(AST_Program_t *program, AST_Index_t expression)
 {
-    AST_Expression_t *e;
+    AST_Index_t e;
+
+    for (e = expression; e != AST_NONE; e = AST_NODE(program, e)->expression.expression) {
+        AST_Expression_t *node = &(AST_NODE(program, e)->expression);
+
+        AST_Index_t       c    = node->command;
 
-    for (e = expression; e; e = e->expression) {
-        if (e->command) {
-            AST_PrintCommand(e->command);
+        if (AST_NODE(program, c)->kind == AST_PIPE) {
+            for (c = AST_NODE(program, c)->pipe.first; c != AST_NONE; c = AST_NODE(program, c)->next) {
+                AST_PrintCommand(program, &(AST_NODE(program, c)->command));
+                if (AST_NODE(program, c)->next != AST_NONE) {
+                    DTRACE("| ");
+                }
+            }
+        } else {
+            AST_PrintCommand(program, &(AST_NODE(program, c)->command));
         }
-        if (e->op) {
-            DTRACE("%s ", e->op->str);
+        if (node->op == TOKEN_ANDAND) {
+            DTRACE("&& ");
+        } else if (node->op == TOKEN_OROR) {
+            DTRACE("|| ");
         }
     }
 }
 
-void AST_PrintPipeline(AST_Pipeline_t *pipeline)
+void AST_PrintPipeline(AST_Program_t *program, AST_Index_t pipeline)
 {
-    if (pipeline->assignment) {
-        AST_PrintAssignment(pipeline->assignment);
-    } else if (pipeline->expression) {
-        AST_PrintExpression(pipeline->expression);
+    AST_Node_t *node = AST_NODE(program, pipeline);
+
+    if (node->kind == AST_ASSIGNMENT) {
+        AST_PrintAssignment(program, &(node->assignment));
+    } else if (node->kind == AST_EXPRESSION) {
+        AST_PrintExpression(program, pipeline);
     }
 
     DTRACE("\n");
 }
 
-void AST_PrintList(AST_List_t *pipeline_list)
+void AST_PrintList(AST_Program_t *program, AST_Index_t list)
 {
-    int i;
+    AST_Index_t p;
 
     DTRACE("=======================================\n");
-    for (i = 0; i < pipeline_list->npipelines; i++) {
-        AST_PrintPipeline(pipeline_list->pipelines[i]);
+    for (p = AST_NODE(program, list)->list.first; p != AST_NONE; p = AST_NODE(program, p)->next) {
+        AST_PrintPipeline(program, p);
     }
     DTRACE("=======================================\n");
 }
 
+void AST_PrintProgram(AST_Program_t *program)
+{
+    AST_PrintList(program, program->list);
+}
+
 /****************************************************************************/
 
-AST_Assignment_t *AST_ParseAssignment(Parser_t *parser, Token_t *var)
+/* Add a node to the program, node pointers don't survive this call */
+static AST_Index_t AST_NodeNew(Parser_t *parser, AST_Kind_t kind)
+{
+    AST_Program_t *program = parser->program;
+    AST_Node_t    *nodes;
+
+    if ((nodes = Arena_Grow(parser->arena, program->nodes,
+                    program->nnodes, sizeof(*nodes))) == NULL) {
+        return AST_NONE;
+    }
+    program->nodes = nodes;
+    program->nodes[program->nnodes].kind = kind;
+
+    return program->nnodes++;
+}
+
+static bool AST_WordAdd(Parser_t *parser, Token_t *word)
 {
-    AST_Assignment_t *assignment;
+    AST_Program_t *program = parser->program;
+    Token_t      **words;
+
+    if ((words = Arena_Grow(parser->arena, program->words,
+                    program->nwords, sizeof(*words))) == NULL) {
+        return false;
+    }
+    program->words = words;
+    program->words[program->nwords++] = word;
+
+    return true;
+}
+
+AST_Index_t AST_ParseAssignment(Parser_t *parser, Token_t *var)
+{
+    AST_Index_t assignment;
 
     DTRACE("%s: Start\n", __func__);
 
-    if ((assignment = calloc(1, sizeof(*assignment))) == NULL) {
+    if ((assignment = AST_NodeNew(parser, AST_ASSIGNMENT)) == AST_NONE) {
         goto assignment_fail;
     }
-    assignment->var   = var;
+    AST_NODE(parser->program, assignment)->assignment.var = var;
 
     /* Variable */
     Scanner_TokenConsume(parser); /* the assignemnt op */
-    if (parser->t->type == TOKEN_STRING || 
+    if (parser->t->type == TOKEN_STRING ||
             parser->t->type == TOKEN_ID ||
-            parser->t->type == TOKEN_DOLLAR) {
-        assignment->value = parser->t;
+            parser->t->type == TOKEN_DOLLAR ||
+            parser->t->type == TOKEN_ARITH) {
+        AST_NODE(parser->program, assignment)->assignment.value = parser->t;
         Scanner_TokenAccept(parser);
     }
 
@@ -137,28 +190,35 @@ AST_Assignment_t *AST_ParseAssignment(Parser_t *parser, Token_t *var)
     return assignment;
 
 assignment_fail:
-    if (assignment) {
-        if (assignment->var) {
-            Scanner_TokenFree(assignment->var);
-            assignment->var = NULL;
-        }
-        free(assignment);
-    }
-
     DTRACE("%s: Fail\n", __func__);
 
-    return NULL;
+    return AST_NONE;
 }
 
-AST_Redirect_t *AST_ParseRedirect(Parser_t *parser)
+/* The operator may start with the fd it replaces, as in 2>&1 */
+static bool AST_ParseRedirect(Parser_t *parser)
 {
-    AST_Redirect_t *redirect = NULL;
+    AST_Program_t  *program = parser->program;
+    AST_Redirect_t *redirects;
+    AST_Redirect_t *redirect;
+    Token_t        *op = parser->t;
 
     DTRACE("%s: Start\n", __func__);
 
-    if ((redirect = calloc(1, sizeof(*redirect))) == NULL) {
+    if ((redirects = Arena_Grow(parser->arena, program->redirects,
+                    program->nredirects, sizeof(*redirects))) == NULL) {
         goto redirect_fail;
     }
+    program->redirects = redirects;
+    redirect = &redirects[program->nredirects];
+
+    redirect->type = op->type;
+    redirect->slot = -1;
+    if (isdigit((unsigned char) op->str[0])) {
+        redirect->fd = atoi(op->str);
+    } else {
+        redirect->fd = (op->str[0] == '<') ? STDIN_FILENO : STDOUT_FILENO;
+    }
 
     /* Consume the direction */
     Scanner_TokenConsume(parser);
@@ -167,64 +227,65 @@ AST_Redirect_t *AST_ParseRedirect(Parser_t *parser)
         parser->t->type == TOKEN_STRING ||
         parser->t->type == TOKEN_DOLLAR)
     {
-        redirect->file = parser->t;
+        redirect->target = parser->t;
         Scanner_TokenAccept(parser);
     } else {
         goto redirect_fail;
     }
 
+    program->nredirects++;
+
     DTRACE("%s: End\n", __func__);
 
-    return redirect;
+    return true;
 
 redirect_fail:
-    if (redirect) {
-        if (redirect->file) {
-            Scanner_TokenFree(redirect->file);
-        }
-        free(redirect);
-    }
-
     DTRACE("%s: Fail\n", __func__);
 
-    return NULL;
+    return false;
 }
 
-AST_Command_t *AST_ParseCommand(Parser_t *parser, Token_t *cmd)
+AST_Index_t AST_ParseCommand(Parser_t *parser, Token_t *cmd)
 {
-    AST_Command_t *command;
-    Token_t **argv;
+    AST_Program_t *program = parser->program;
+    AST_Index_t    command;
+    uint32_t       argv;
+    uint32_t       redirects;
 
     DTRACE("%s: Start\n", __func__);
 
-    if ((command = calloc(1, sizeof(*command))) == NULL) {
+    if ((command = AST_NodeNew(parser, AST_COMMAND)) == AST_NONE) {
         goto command_fail;
     }
 
-    argv = realloc(command->argv, sizeof(*(command->argv))*(command->argc+1));
-    command->argv = argv;
-    command->argv[command->argc++] = cmd;
+    /* Arguments of a command are always next to each other in words */
+    argv      = program->nwords;
+    redirects = program->nredirects;
+    if (!AST_WordAdd(parser, cmd)) {
+        goto command_fail;
+    }
 
     /* Command */
     while (parser->t->type != TOKEN_EOF) {
-        if (parser->t->type == TOKEN_STRING || 
+        if (parser->t->type == TOKEN_STRING ||
             parser->t->type == TOKEN_ID     ||
-            parser->t->type == TOKEN_DOLLAR) {
+            parser->t->type == TOKEN_DOLLAR ||
+            parser->t->type == TOKEN_ARITH) {
 
-            if ((argv = realloc(command->argv, sizeof(*(command->argv))*(command->argc+1))) == NULL) {
+            if (!AST_WordAdd(parser, parser->t)) {
                 goto command_fail;
             }
-            
-            command->argv = argv;
-            command->argv[command->argc++] = parser->t;
 
             Scanner_TokenAccept(parser);
-        } else if (parser->t->type == TOKEN_LEFTARROW)  {
-            command->in = AST_ParseRedirect(parser);
-        } else if (parser->t->type == TOKEN_RIGHTARROW) {
-            command->out = AST_ParseRedirect(parser);
+        } else if (parser->t->type == TOKEN_LEFTARROW  ||
+                   parser->t->type == TOKEN_RIGHTARROW ||
+                   parser->t->type == TOKEN_APPEND     ||
+                   parser->t->type == TOKEN_DUP) {
+            if (!AST_ParseRedirect(parser)) {
+                goto command_fail;
+            }
         } else if (parser->t->type == TOKEN_AND)        {
-            command->background = true;
+            AST_NODE(program, command)->command.background = true;
             Scanner_TokenConsume(parser);
             break;
         } else {
@@ -232,66 +293,121 @@ AST_Command_t *AST_ParseCommand(Parser_t *parser, Token_t *cmd)
         }
     }
 
+    AST_NODE(program, command)->command.redirects  = redirects;
+    AST_NODE(program, command)->command.nredirects = program->nredirects - redirects;
+    AST_NODE(program, command)->command.argv = argv;
+    AST_NODE(program, command)->command.argc = program->nwords - argv;
+
     DTRACE("%s: End\n", __func__);
 
     return command;
 
 command_fail:
-    if (command) {
-        if (command->argv) {
-            int i;
-            for (i = 0; i < command->argc; i++) {
-                free(command->argv[i]);
-                command->argv[i] = NULL;
-            }
-            free(command->argv);
-            command->argv = NULL;
+    DTRACE("%s: Fail\n", __func__);
+
+    return AST_NONE;
+}
+
+/* Carry on from the first command of a | b | c */
+static AST_Index_t AST_ParsePipe(Parser_t *parser, AST_Index_t first)
+{
+    AST_Program_t *program = parser->program;
+    AST_Index_t    pipe;
+    AST_Index_t    prev = first;
+    AST_Index_t    command;
+    Token_t       *cmd;
+
+    DTRACE("%s: Start\n", __func__);
+
+    if ((pipe = AST_NodeNew(parser, AST_PIPE)) == AST_NONE) {
+        goto pipe_fail;
+    }
+    AST_NODE(program, pipe)->pipe.first     = first;
+    AST_NODE(program, pipe)->pipe.ncommands = 1;
+
+    while (parser->t->type == TOKEN_PIPE) {
+        Scanner_TokenConsume(parser);
+
+        /* The next command may be on the following line */
+        while (parser->t->type == TOKEN_NEWLINE) {
+            Scanner_TokenConsume(parser);
         }
-        if (command->in) {
-            AST_FreeRedirect(command->in);
-            command->in = NULL;
+
+        if (parser->t->type != TOKEN_ID     &&
+                parser->t->type != TOKEN_STRING &&
+                parser->t->type != TOKEN_DOLLAR) {
+            goto pipe_fail;
         }
-        if (command->out) {
-            AST_FreeRedirect(command->out);
-            command->out = NULL;
+        cmd = parser->t;
+        Scanner_TokenAccept(parser);
+
+        if ((command = AST_ParseCommand(parser, cmd)) == AST_NONE) {
+            goto pipe_fail;
         }
-        free(command);
-        command = NULL;
+        AST_NODE(program, prev)->next = command;
+        AST_NODE(program, pipe)->pipe.ncommands++;
+        prev = command;
     }
 
-    DTRACE("%s: Fail\n", __func__);
+    DTRACE("%s: End\n", __func__);
+
+    return pipe;
+
+pipe_fail:
+    fprintf(stderr, "ERROR: Parsing %s\n", __func__);
 
-    return NULL;
+    return AST_NONE;
 }
 
-AST_Expression_t *AST_ParseExpression(Parser_t *parser, Token_t *cmd)
+AST_Index_t AST_ParseExpression(Parser_t *parser, Token_t *cmd)
 {
-    AST_Expression_t *expression = NULL;
+    AST_Program_t *program    = parser->program;
+    AST_Index_t    expression = AST_NONE;
+    AST_Index_t    prev       = AST_NONE;
+    AST_Index_t    e;
+    AST_Index_t    command;
 
     if (cmd == NULL) {
         cmd = parser->t;
         Scanner_TokenAccept(parser);
     }
 
-    /* TODO: Convert this into a while loop */
-    if ((expression = calloc(1, sizeof(*expression))) == NULL) {
-        goto expression_fail;
-    }
+    for (;;) {
+        if ((e = AST_NodeNew(parser, AST_EXPRESSION)) == AST_NONE) {
+            goto expression_fail;
+        }
+        if ((command = AST_ParseCommand(parser, cmd)) == AST_NONE) {
+            goto expression_fail;
+        }
+        if (parser->t->type == TOKEN_PIPE &&
+                (command = AST_ParsePipe(parser, command)) == AST_NONE) {
+            goto expression_fail;
+        }
+        AST_NODE(program, e)->expression.command = command;
+
+        if (prev == AST_NONE) {
+            expression = e;
+        } else {
+            AST_NODE(program, prev)->expression.expression = e;
+        }
+        prev = e;
+
+        if ((parser->t->type != TOKEN_OROR) && (parser->t->type != TOKEN_ANDAND)) {
+            break;
+        }
 
-    expression->command = AST_ParseCommand(parser, cmd);
-    if ((parser->t->type == TOKEN_OROR) || (parser->t->type == TOKEN_ANDAND)) {
         /* Consume the || or && */
-        expression->op = parser->t;
+        AST_NODE(program, e)->expression.op = parser->t->type;
         Scanner_TokenAccept(parser);
 
-        /* Parse Expression expects the ID to already be accepted */
-        if (parser->t->type != TOKEN_ID     && 
+        /* The next command starts with its name */
+        if (parser->t->type != TOKEN_ID     &&
                 parser->t->type != TOKEN_STRING &&
                 parser->t->type != TOKEN_DOLLAR) {
             goto expression_fail;
         }
-
-        expression->expression = AST_ParseExpression(parser, NULL);
+        cmd = parser->t;
+        Scanner_TokenAccept(parser);
     }
 
     while (parser->t->type == TOKEN_NEWLINE) {
@@ -301,40 +417,23 @@ AST_Expression_t *AST_ParseExpression(Parser_t *parser, Token_t *cmd)
     return expression;
 
 expression_fail:
-    {
-        AST_Expression_t *e;
-        AST_Expression_t *next;
-        for (e = expression; e; e = next) {
-            next = e->expression;
-            
-            if (e->op) {
-                Scanner_TokenFree(e->op);
-            }
-            free(e);
-            e = next;
-        }
-    }
-    return NULL;
+    return AST_NONE;
 }
 
-AST_Pipeline_t *AST_ParseExpressionOrAssignment(Parser_t *parser)
+AST_Index_t AST_ParseExpressionOrAssignment(Parser_t *parser)
 {
-    AST_Pipeline_t *pipeline;
-    Token_t         *cmd_or_var;
+    AST_Index_t pipeline;
+    Token_t    *cmd_or_var;
 
     DTRACE("%s: Start\n", __func__);
 
-    if ((pipeline = calloc(1, sizeof(*pipeline))) == NULL) {
-        return NULL;
-    }
-
     cmd_or_var = parser->t;
     Scanner_TokenAccept(parser);
 
     if (parser->t->type == TOKEN_EQUALS) {
-        pipeline->assignment = AST_ParseAssignment(parser, cmd_or_var);
+        pipeline = AST_ParseAssignment(parser, cmd_or_var);
     } else {
-        pipeline->expression = AST_ParseExpression(parser, cmd_or_var);
+        pipeline = AST_ParseExpression(parser, cmd_or_var);
     }
 
     if (parser->t->type == TOKEN_SEMICOLON) {
@@ -346,30 +445,31 @@ AST_Pipeline_t *AST_ParseExpressionOrAssignment(Parser_t *parser)
     return pipeline;
 }
 
-AST_Pipeline_t *AST_ParseIfPipeline(Parser_t *parser)
+AST_Index_t AST_ParseIfPipeline(Parser_t *parser)
 {
-    AST_Pipeline_t   *pipeline  = NULL;
-
-    if ((pipeline = calloc(1, sizeof(*pipeline))) == NULL) {
-        goto if_fail;
-    }
+    AST_Program_t *program = parser->program;
+    AST_Index_t    pipeline;
+    AST_Index_t    list;
 
-    if ((pipeline->ifpipeline = calloc(1, sizeof(*(pipeline->ifpipeline)))) == NULL) {
+    if ((pipeline = AST_NodeNew(parser, AST_IF)) == AST_NONE) {
         goto if_fail;
     }
 
     Scanner_TokenConsume(parser);
-    pipeline->ifpipeline->test = AST_ParseList(parser);
+    list = AST_ParseList(parser);
+    AST_NODE(program, pipeline)->ifpipeline.test = list;
 
     if (parser->t->type != TOKEN_THEN) {
         goto if_fail;
     }
     Scanner_TokenConsume(parser);
-    pipeline->ifpipeline->pipeline = AST_ParsePipeline(parser);
+    list = AST_ParseList(parser);
+    AST_NODE(program, pipeline)->ifpipeline.list = list;
 
     if (parser->t->type == TOKEN_ELSE) {
         Scanner_TokenConsume(parser);
-        pipeline->ifpipeline->elsepipeline = AST_ParsePipeline(parser);
+        list = AST_ParseList(parser);
+        AST_NODE(program, pipeline)->ifpipeline.elselist = list;
     }
 
     if (parser->t->type != TOKEN_FI) {
@@ -382,75 +482,69 @@ AST_Pipeline_t *AST_ParseIfPipeline(Parser_t *parser)
 if_fail:
     fprintf(stderr, "ERROR: Parsing %s\n", __func__);
 
-    if (pipeline) {
-        AST_FreePipeline(pipeline);
-    }
-
-    return NULL;
+    return AST_NONE;
 }
 
-AST_Words_t *AST_ParseWords(Parser_t *parser)
+AST_Index_t AST_ParseForPipeline(Parser_t *parser)
 {
-    AST_Words_t *words = NULL;
-    Token_t **w;
+    AST_Program_t *program = parser->program;
+    AST_Index_t    pipeline;
+    AST_Index_t    list;
+    uint32_t       words;
 
-    if ((words = calloc(1, sizeof(*words))) == NULL) {
-        goto words_fail;
-    }
+    DTRACE("%s: Start\n", __func__);
 
-    while (parser->t->type  == TOKEN_STRING ||
-            parser->t->type == TOKEN_ID     ||
-            parser->t->type == TOKEN_DOLLAR) {
-        if ((w = realloc(words->words, sizeof(*words->words)*(words->nwords+1))) == NULL) {
-            goto words_fail;
-        }
-        words->words = w;
-        words->words[words->nwords++] = parser->t;
-        Scanner_TokenAccept(parser);
+    if ((pipeline = AST_NodeNew(parser, AST_FOR)) == AST_NONE) {
+        goto for_fail;
     }
 
-    while (parser->t->type == TOKEN_NEWLINE) {
-        Scanner_TokenConsume(parser);
-    }
+    Scanner_TokenConsume(parser);
 
-    return words;
+    /* for -P N runs N iterations at a time */
+    if (parser->t->type == TOKEN_ID && strncmp(parser->t->str, "-P", 2) == 0) {
+        const char *n = parser->t->str + 2;
+        char       *end;
+        long        workers;
 
-words_fail:
-    if (words) {
-        if (words->words) {
-            int i;
-            for (i = 0; i < words->nwords; i++) {
-                Scanner_TokenFree(words->words[i]);
-            }
-            free(words->words);
+        if (*n == '\0') {
+            Scanner_TokenConsume(parser);
+            n = (parser->t->type == TOKEN_ID) ? parser->t->str : "";
         }
-        free(words);
-    }
-
-    return NULL;
-}
-
-AST_Pipeline_t *AST_ParseForPipeline(Parser_t *parser)
-{
-    AST_Pipeline_t *pipeline = NULL;
-
-    DTRACE("%s: Start\n", __func__);
-
-    if ((pipeline = calloc(1, sizeof(*pipeline))) == NULL) {
-        goto for_fail;
-    }
-    if ((pipeline->forpipeline = calloc(1, sizeof(*(pipeline->forpipeline)))) == NULL) {
-        goto for_fail;
+        workers = strtol(n, &end, 10);
+        if (!isdigit((unsigned char) *n) || *end != '\0' || workers > UINT32_MAX) {
+            fprintf(stderr, "for: -P %s: not a number of workers\n", n);
+            goto for_fail;
+        }
+        AST_NODE(program, pipeline)->forpipeline.parallel = true;
+        AST_NODE(program, pipeline)->forpipeline.workers  = workers;
+        Scanner_TokenConsume(parser);
     }
 
-    Scanner_TokenConsume(parser);
-    pipeline->forpipeline->var = parser->t;
+    AST_NODE(program, pipeline)->forpipeline.var = parser->t;
     Scanner_TokenAccept(parser);
 
     /* Support for loops without the IN token */
     if (parser->t->type == TOKEN_ID && (strcmp(parser->t->str, "in") == 0)) {
         Scanner_TokenConsume(parser);
-        pipeline->forpipeline->words = AST_ParseWords(parser);
+
+        words = program->nwords;
+        while (parser->t->type  == TOKEN_STRING ||
+                parser->t->type == TOKEN_ID     ||
+                parser->t->type == TOKEN_DOLLAR) {
+            if (!AST_WordAdd(parser, parser->t)) {
+                goto for_fail;
+            }
+            Scanner_TokenAccept(parser);
+        }
+        AST_NODE(program, pipeline)->forpipeline.words  = words;
+        AST_NODE(program, pipeline)->forpipeline.nwords = program->nwords - words;
+
+        if (parser->t->type == TOKEN_SEMICOLON) {
+            Scanner_TokenConsume(parser);
+        }
+        while (parser->t->type == TOKEN_NEWLINE) {
+            Scanner_TokenConsume(parser);
+        }
     }
 
     if (parser->t->type != TOKEN_DO) {
@@ -459,35 +553,31 @@ AST_Pipeline_t *AST_ParseForPipeline(Parser_t *parser)
     }
     Scanner_TokenConsume(parser);
 
-    pipeline->forpipeline->list = AST_ParseList(parser);
+    list = AST_ParseList(parser);
+    AST_NODE(program, pipeline)->forpipeline.list = list;
 
     if (parser->t->type != TOKEN_DONE) {
         fprintf(stderr, "Found wrong token expected %d got %d\n", TOKEN_DONE, parser->t->type);
         goto for_fail;
     }
+    Scanner_TokenConsume(parser);
 
-    printf("%s: Done\n", __func__);
+    DTRACE("%s: Done\n", __func__);
 
     return pipeline;
 
 for_fail:
     fprintf(stderr, "ERROR: Parsing %s\n", __func__);
 
-    if (pipeline) {
-        AST_FreePipeline(pipeline);
-    }
-
-    return NULL;
+    return AST_NONE;
 }
 
-char *tick_ch;
-
 int AST_ParseTickGetChar(struct Parser *parser, int timeout)
 {
     (void) timeout;
     int c;
-    
-    c = *tick_ch++;
+
+    c = (unsigned char) *parser->LineChar++;
     if (c == '\0') {
         return EOF;
     }
@@ -495,58 +585,67 @@ int AST_ParseTickGetChar(struct Parser *parser, int timeout)
     return c;
 }
 
-AST_Pipeline_t *AST_ParseTickPipeline(Parser_t *parser)
+AST_Index_t AST_ParseTickPipeline(Parser_t *parser)
 {
-    AST_Pipeline_t *pipeline    = NULL;
-    AST_List_t     *tick_pipeline_list = NULL;
+    AST_Program_t  *tick_program = NULL;
     Parser_t        tick_parser;
+    Arena_Mark_t    mark;
 
     DTRACE("%s: Start\n", __func__);
 
     /* Setup a new pipeline_list to consume the text between the ticks */
     memset(&tick_parser, 0, sizeof(tick_parser));
-    tick_parser.linenum = parser->linenum;
-    tick_parser.colnum  = parser->colnum;
-    tick_ch             = parser->t->str;
-    tick_parser.getchar = AST_ParseTickGetChar;
+    tick_parser.linenum  = parser->linenum;
+    tick_parser.colnum   = parser->colnum;
+    tick_parser.LineChar = parser->t->str;
+    tick_parser.getchar  = AST_ParseTickGetChar;
+    tick_parser.arena    = parser->arena;
+
+    /* The tick program is thrown away once it has run, so it can share the
+     * parent's arena and give it back straight after */
+    mark = Arena_Mark(parser->arena);
 
     /* Setup first char, and token */
-    tick_parser.c       = tick_parser.getchar(&tick_parser, 1000);
+    Scanner_Start(&tick_parser);
     tick_parser.t       = Scanner_TokenNext(&tick_parser);
 
     /* Run the tick pipeline_list */
     /* TODO: Set the print path so we can absorb the output */
-    if ((tick_pipeline_list = AST_ParseProgram(&tick_parser)) == NULL) {
+    if ((tick_program = AST_ParseProgram(&tick_parser)) == NULL) {
         goto tick_fail;
     }
 
-    AST_ProcessList(tick_pipeline_list);
-    AST_FreeList(tick_pipeline_list);
+    AST_ProcessProgram(tick_program);
+
+    /* It shares the parent's arena, anything it left running has to be
+     * done before that is given back */
+    if (tick_program->refs > 0) {
+        Task_JoinAll();
+    }
+    Arena_Release(parser->arena, mark);
 
     /* Consume the whole tick token */
     Scanner_TokenConsume(parser);
 
     DTRACE("%s: Done\n", __func__);
 
-    return pipeline;
+    return AST_NONE;
 
 tick_fail:
     /* TODO: */
     fprintf(stderr, "ERROR: Parsing %s\n", __func__);
-    if (pipeline) {
-        AST_FreePipeline(pipeline);
-    }
-    return NULL;
+    Arena_Release(parser->arena, mark);
+
+    return AST_NONE;
 }
 
-AST_Pipeline_t *AST_ParseWhilePipeline(Parser_t *parser)
+AST_Index_t AST_ParseWhilePipeline(Parser_t *parser)
 {
-    AST_Pipeline_t *pipeline = NULL;
+    AST_Program_t *program = parser->program;
+    AST_Index_t    pipeline;
+    AST_Index_t    list;
 
-    if ((pipeline = calloc(1, sizeof(*pipeline))) == NULL) {
-        goto while_fail;
-    }
-    if ((pipeline->whilepipeline = calloc(1, sizeof(*(pipeline->whilepipeline)))) == NULL) {
+    if ((pipeline = AST_NodeNew(parser, AST_WHILE)) == AST_NONE) {
         goto while_fail;
     }
 
@@ -555,7 +654,8 @@ AST_Pipeline_t *AST_ParseWhilePipeline(Parser_t *parser)
 
     /* Parse the test */
     if (parser->t->type != TOKEN_DO) {
-        pipeline->whilepipeline->test = AST_ParseList(parser);
+        list = AST_ParseList(parser);
+        AST_NODE(program, pipeline)->whilepipeline.test = list;
     }
 
     /* consume the do */
@@ -567,7 +667,8 @@ AST_Pipeline_t *AST_ParseWhilePipeline(Parser_t *parser)
 
     /* Parse the body */
     if (parser->t->type != TOKEN_DONE) {
-        pipeline->whilepipeline->list = AST_ParseList(parser);
+        list = AST_ParseList(parser);
+        AST_NODE(program, pipeline)->whilepipeline.list = list;
     }
 
     /* consume the done */
@@ -580,15 +681,13 @@ AST_Pipeline_t *AST_ParseWhilePipeline(Parser_t *parser)
 
 while_fail:
     fprintf(stderr, "ERROR: Parsing %s\n", __func__);
-    if (pipeline) {
-        AST_FreePipeline(pipeline);
-    }
-    return NULL;
+
+    return AST_NONE;
 }
 
-AST_Pipeline_t *AST_ParsePipeline(Parser_t *parser)
+AST_Index_t AST_ParsePipeline(Parser_t *parser)
 {
-    AST_Pipeline_t *pipeline;
+    AST_Index_t pipeline;
 
     DTRACE("%s: Start\n", __func__);
 
@@ -599,6 +698,7 @@ AST_Pipeline_t *AST_ParsePipeline(Parser_t *parser)
     switch(parser->t->type) {
         case TOKEN_ID:
         case TOKEN_STRING:
+        case TOKEN_DOLLAR:
             pipeline = AST_ParseExpressionOrAssignment(parser);
             break;
 
@@ -619,10 +719,17 @@ AST_Pipeline_t *AST_ParsePipeline(Parser_t *parser)
             break;
 
         default:
-            pipeline = NULL;
+            pipeline = AST_NONE;
             break;
     }
 
+    /* A whole if or loop can be left running with &, a command has already
+     * taken its own */
+    if (pipeline != AST_NONE && parser->t->type == TOKEN_AND) {
+        AST_NODE(parser->program, pipeline)->background = true;
+        Scanner_TokenConsume(parser);
+    }
+
     while (parser->t->type == TOKEN_NEWLINE) {
         Scanner_TokenConsume(parser);
     }
@@ -632,60 +739,61 @@ AST_Pipeline_t *AST_ParsePipeline(Parser_t *parser)
     return pipeline;
 }
 
-AST_List_t *AST_ParseList(Parser_t *parser)
+AST_Index_t AST_ParseList(Parser_t *parser)
 {
-    AST_List_t *pipeline_list;
-    AST_Pipeline_t *pipeline;
-    AST_Pipeline_t **pipelines;
+    AST_Program_t *program = parser->program;
+    AST_Index_t    pipeline_list;
+    AST_Index_t    pipeline;
+    AST_Index_t    prev = AST_NONE;
 
     DTRACE("%s: Start\n", __func__);
 
-    if ((pipeline_list = calloc(1, sizeof(*pipeline_list))) == NULL) {
-        return NULL;
+    if ((pipeline_list = AST_NodeNew(parser, AST_LIST)) == AST_NONE) {
+        return AST_NONE;
     }
 
     while (parser->t->type != TOKEN_EOF) {
-        if ((pipeline = AST_ParsePipeline(parser))) {
-            pipelines = realloc(pipeline_list->pipelines, 
-                    sizeof(*(pipeline_list->pipelines))*(pipeline_list->npipelines+1));
-            if (pipelines == NULL) {
-                goto pipeline_list_fail;
-            } else {
-                pipeline_list->pipelines = pipelines;
-                pipeline_list->pipelines[pipeline_list->npipelines++] = pipeline;
-            }
-        } else {
+        if ((pipeline = AST_ParsePipeline(parser)) == AST_NONE) {
             break;
         }
+
+        if (prev == AST_NONE) {
+            AST_NODE(program, pipeline_list)->list.first = pipeline;
+        } else {
+            AST_NODE(program, prev)->next = pipeline;
+        }
+        AST_NODE(program, pipeline_list)->list.npipelines++;
+        prev = pipeline;
     }
 
     DTRACE("%s: End\n", __func__);
 
     return pipeline_list;
-
-pipeline_list_fail:
-    if (pipeline_list) {
-        if (pipeline_list->pipelines) {
-            free(pipeline_list->pipelines);
-        }
-        free(pipeline_list);
-    }
-
-    return NULL;
 }
 
-AST_List_t *AST_ParseProgram(Parser_t *parser)
+AST_Program_t *AST_ParseProgram(Parser_t *parser)
 {
-    AST_List_t *pipeline_list;
+    AST_Program_t *program;
 
-    pipeline_list = AST_ParseList(parser);
+    if ((program = Arena_Alloc(parser->arena, sizeof(*program))) == NULL) {
+        return NULL;
+    }
+    program->arena  = parser->arena;
+    program->nnodes = 1;    /* AST_NONE */
+    parser->program = program;
 
-    Scanner_TokenFree(parser->t);
+    if ((program->list = AST_ParseList(parser)) == AST_NONE) {
+        return NULL;
+    }
     parser->t = NULL;
 
+    if (VM_Compile(program) < 0) {
+        return NULL;
+    }
+
     DTRACE("%s: End\n", __func__);
 
-    return pipeline_list;
+    return program;
 }
 
 void AST_ParseCleanup(Parser_t *parser)
@@ -693,343 +801,210 @@ void AST_ParseCleanup(Parser_t *parser)
 }
 
 /****************************************************************************/
-int AST_ProcessAssignment(AST_Assignment_t *assignment)
+int AST_ProcessAssignment(AST_Program_t *program, AST_Assignment_t *assignment)
 {
     char *value;
-    if (assignment->value) {
-        value = assignment->value->str;
-    } else {
-        value = "";
-    }
-    my_setenv(assignment->var->str, value, true);
-
-    return 0;
-}
-
-int AST_ProcessCommand(AST_Command_t *command) 
-{
-    int argc = command->argc;
-    char **argv;
-    int i;
-    int r;
-    char r_str[5];
+    long  num;
 
-    if ((argv = calloc(argc, sizeof(*argv))) == NULL) {
-        goto process_command_fail;
-    }
-
-    /* Create the command arguments */
-    for (i = 0; i < argc; i++) {
-        char *value;
-
-        if (command->argv[i]->type == TOKEN_DOLLAR) {
-            if ((value = my_getenv(command->argv[i]->str)) == NULL) {
-                value = "";
-            }
-        } else {
-            value = command->argv[i]->str;
-        }
-
-        /* Take a copy of the string */
-        if ((argv[i] = strdup(value)) == NULL) {
-            goto process_command_fail;
+    /* Arithmetic results are kept as numbers */
+    if (assignment->arith) {
+        if (Arith_Eval(program, assignment->arith, &num) < 0) {
+            Shell_VarSetInt(program->status, 1);
+            return 1;
         }
+        Shell_VarSetInt(assignment->slot, num);
+        return 0;
     }
 
-    r = Shell_RunCommand(argc, argv, command->background);
-    snprintf(r_str, sizeof(r_str), "%d", r);
-    my_setenv("?", r_str, true);
-
-    return r;
-
-process_command_fail:
-    if (argv) {
-        for (i = 0; i < argc; i++) {
-            if (argv[i]) {
-                free(argv[i]);
-            }
+    if (assignment->source >= 0) {
+        if ((value = Shell_VarGet(assignment->source)) == NULL) {
+            value = "";
         }
-        free(argv);
+    } else if (assignment->value) {
+        value = assignment->value->str;
+    } else {
+        value = "";
     }
+    Shell_VarSet(assignment->slot, value);
 
-    return -ENOMEM;
+    return 0;
 }
 
-int AST_ProcessExpression(AST_Expression_t *expression)
+/* Undo the first n redirections of command, last first */
+void AST_RestoreRedirects(AST_Program_t *program, AST_Command_t *command,
+        int *saved, uint32_t n)
 {
-    int r = 0;
-
-    if (expression) {
-        /* TODO: Convert to a while loop */
-        r = AST_ProcessCommand(expression->command);
-
-        if (expression->op) {
-            if ((expression->op->type == TOKEN_ANDAND && (r == 0)) ||
-                (expression->op->type == TOKEN_OROR   && (r != 0)) ||
-                (expression->op->type == TOKEN_SEMICOLON)) {
-                r = AST_ProcessExpression(expression->expression);
-            } else {
-                DTRACE("Ignoring expression due to truth condition\n");
-            }
-        }
+    while (n-- > 0) {
+        Shell_RedirectRestore(program->redirects[command->redirects + n].fd, saved[n]);
     }
-
-    return r;
 }
 
-int AST_ProcessIfPipeline(AST_IfPipeline_t *ifpipeline)
+int AST_ApplyRedirects(AST_Program_t *program, AST_Command_t *command, int *saved)
 {
-    int r = 0;
+    const char *target;
+    uint32_t    i;
 
-    if (ifpipeline->test) {
-        r = AST_ProcessList(ifpipeline->test);
-    }
+    for (i = 0; i < command->nredirects; i++) {
+        AST_Redirect_t *redirect = &program->redirects[command->redirects + i];
 
-    if (r) {
-        r = AST_ProcessPipeline(ifpipeline->pipeline);
-    } else if (ifpipeline->elsepipeline) {
-        r = AST_ProcessPipeline(ifpipeline->elsepipeline);
-    }
-
-    return r;
-}
-
-int AST_ProcessForPipeline(AST_ForPipeline_t *forpipeline)
-{
-    int i;
-    int r = 0;
+        target = redirect->target->str;
+        if (redirect->slot >= 0 && (target = Shell_VarGet(redirect->slot)) == NULL) {
+            target = "";
+        }
 
-    if (forpipeline->words) {
-        for (i = 0; i < forpipeline->words->nwords; i++) {
-            my_setenv(forpipeline->var->str, forpipeline->words->words[i]->str, true);
-            r = AST_ProcessList(forpipeline->list);
+        if (Shell_Redirect(redirect->type, redirect->fd, target, &saved[i]) < 0) {
+            AST_RestoreRedirects(program, command, saved, i);
+            return -EINVAL;
         }
-    } else {
-        /* TODO */
     }
 
-    return r;
-}
-
-int AST_ProcessTickPipeline(AST_Pipeline_t *tickpipeline)
-{
-    /* TODO: */
     return 0;
 }
 
-int AST_ProcessWhilePipeline(AST_WhilePipeline_t *whilepipeline)
+/* Fill in the $var and $(( )) arguments of command, the text of each number
+ * goes in nums. Returns the argv to run with, or NULL when the arithmetic
+ * fails */
+static char **AST_ExpandCommand(AST_Program_t *program, AST_Command_t *command,
+        char **argv, char (*nums)[AST_NUM_SIZE])
 {
-    int r;
+    uint32_t i;
+    long     num;
 
-    //printf("%s: Start\n", __func__);
-
-    while ((whilepipeline->test == NULL) || 
-          ((r = AST_ProcessList(whilepipeline->test)) == 0)) {
-
-        if (whilepipeline->list) {
-            AST_ProcessList(whilepipeline->list);
-        }
+    /* Literal arguments are passed straight from the AST */
+    if (!command->dynamic) {
+        return command->args;
     }
 
-    return 0;
-}
-
-int AST_ProcessPipeline(AST_Pipeline_t *pipeline)
-{
-    int r = 0;
-
-    if (pipeline) {
-        if (pipeline->assignment) {
-            r = AST_ProcessAssignment(pipeline->assignment);
-        } 
-        if (pipeline->expression) {
-            r = AST_ProcessExpression(pipeline->expression);
-        }
-        if (pipeline->ifpipeline) {
-            r = AST_ProcessIfPipeline(pipeline->ifpipeline);
-        }
-        if (pipeline->forpipeline) {
-            r = AST_ProcessForPipeline(pipeline->forpipeline);
-        }
-        if (pipeline->tickpipeline) {
-            r = AST_ProcessTickPipeline(pipeline->tickpipeline);
-        }
-        if (pipeline->whilepipeline) {
-            r = AST_ProcessWhilePipeline(pipeline->whilepipeline);
+    for (i = 0; i < command->argc; i++) {
+        if (command->ariths && command->ariths[i]) {
+            if (Arith_Eval(program, command->ariths[i], &num) < 0) {
+                return NULL;
+            }
+            snprintf(nums[i], sizeof(nums[i]), "%ld", num);
+            argv[i] = nums[i];
+        } else if (command->slots[i] < 0) {
+            argv[i] = command->args[i];
+        } else if ((argv[i] = Shell_VarGet(command->slots[i])) == NULL) {
+            argv[i] = "";
         }
     }
+    argv[command->argc] = NULL;
 
-    return r;
+    return argv;
 }
 
-int AST_ProcessList(AST_List_t *pipeline_list)
+static Builtin_Func_t AST_CommandBuiltin(AST_Command_t *command, char **argv)
 {
-    int i;
-    int r = 0;
-
-    for (i = 0; i < pipeline_list->npipelines; i++) {
-        r = AST_ProcessPipeline(pipeline_list->pipelines[i]);
+    if (command->dynamic && command->args[0] == NULL) {
+        return Shell_BuiltinLookup(argv[0]);
     }
 
-    return r;
+    return command->builtin;
 }
 
-/****************************************************************************/
-
-void AST_FreeAssignment(AST_Assignment_t *assignment)
+/* argv is only used when there are variables to expand and is overwritten by
+ * the next command */
+int AST_ProcessCommand(AST_Program_t *program, AST_Command_t *command, char **argv)
 {
-    if (assignment->var) {
-        Scanner_TokenFree(assignment->var);
-        assignment->var = NULL;
-    }
+    Builtin_Func_t builtin;
+    int  r;
+    char nums[command->ariths ? command->argc : 1][AST_NUM_SIZE];
+    int  saved[command->nredirects ? command->nredirects : 1];
 
-    if (assignment->value) {
-        Scanner_TokenFree(assignment->value);
-        assignment->value = NULL;
+    if ((argv = AST_ExpandCommand(program, command, argv, nums)) == NULL) {
+        Shell_VarSetInt(program->status, 1);
+        return 1;
     }
-    free(assignment);
-    assignment = NULL;
-}
+    builtin = AST_CommandBuiltin(command, argv);
 
-void AST_FreeRedirect(AST_Redirect_t *redirect)
-{
-    Scanner_TokenFree(redirect->file);
-    free(redirect);
-}
-
-void AST_FreeCommand(AST_Command_t *command)
-{
-    if (command->argv) {
-        int i;
-        for (i = 0; i < command->argc; i++) {
-            Scanner_TokenFree(command->argv[i]);
-        }
-        free(command->argv);
-    }
+    if (Shell_Collecting()) {
+        /* Output is collected and the fds are shared with whatever else
+         * runs alongside, anything that needs them of its own runs in a
+         * child */
+        Shell_Stage_t stage = { builtin, command->argc, argv, program, command };
 
-    if (command->in) {
-        AST_FreeRedirect(command->in);
-    }
-    if (command->out) {
-        AST_FreeRedirect(command->out);
+        r = Shell_RunPipeline(&stage, 1);
+    } else if (command->nredirects == 0) {
+        r = Shell_RunCommand(builtin, command->argc, argv, command->background);
+    } else if (AST_ApplyRedirects(program, command, saved) < 0) {
+        r = 1;
+    } else {
+        r = Shell_RunCommand(builtin, command->argc, argv, command->background);
+        AST_RestoreRedirects(program, command, saved, command->nredirects);
     }
+    Shell_VarSetInt(program->status, r);
 
-    free(command);
+    return r;
 }
 
-void AST_FreeExpression(AST_Expression_t *expression)
+/* Every stage is expanded before any of them starts */
+int AST_ProcessPipe(AST_Program_t *program, AST_Pipe_t *pipe)
 {
-    AST_Expression_t *e;
-    AST_Expression_t *next;
+    Shell_Stage_t stages[pipe->ncommands];
+    char         *argv[pipe->nargs + pipe->ncommands];
+    char          nums[pipe->nargs][AST_NUM_SIZE];
+    AST_Index_t   c = pipe->first;
+    uint32_t      next = 0;
+    uint32_t      s;
+    int           r;
 
-    for (e = expression; e; e = next) {
-        next = e->expression;
+    for (s = 0; s < pipe->ncommands; s++, c = AST_NODE(program, c)->next) {
+        AST_Command_t *command = &(AST_NODE(program, c)->command);
 
-        if (e->command) {
-            AST_FreeCommand(e->command);
-        }
-        if (e->op) {
-            Scanner_TokenFree(e->op);
+        stages[s].program = program;
+        stages[s].command = command;
+        stages[s].argc    = command->argc;
+        if ((stages[s].argv = AST_ExpandCommand(program, command,
+                        &argv[next + s], &nums[next])) == NULL) {
+            Shell_VarSetInt(program->status, 1);
+            return 1;
         }
-
-        free(e);
+        stages[s].builtin = AST_CommandBuiltin(command, stages[s].argv);
+        next += command->argc;
     }
-}
 
-void AST_FreeIfPipeline(AST_IfPipeline_t *ifpipeline)
-{
-    if (ifpipeline->test) {
-        AST_FreeList(ifpipeline->test);
-    }
-    if (ifpipeline->pipeline) {
-        AST_FreePipeline(ifpipeline->pipeline);
-    }
-    if (ifpipeline->elsepipeline) {
-        AST_FreePipeline(ifpipeline->elsepipeline);
-    }
-    free(ifpipeline);
-}
+    r = Shell_RunPipeline(stages, pipe->ncommands);
+    Shell_VarSetInt(program->status, r);
 
-void AST_FreeWords(AST_Words_t *words) 
-{
-    int i;
-
-    if (words->words) {
-        for (i = 0; i < words->nwords; i++) {
-            Scanner_TokenFree(words->words[i]);
-            words->words[i] = NULL;
-        }
-        free(words->words);
-        words->words = NULL;
-    }
-
-    free(words);
+    return r;
 }
 
-void AST_FreeForPipeline(AST_ForPipeline_t *forpipeline)
+int AST_ProcessProgram(AST_Program_t *program)
 {
-    if (forpipeline->var) {
-        Scanner_TokenFree(forpipeline->var);
-    } 
-    if (forpipeline->words) {
-        AST_FreeWords(forpipeline->words);
-    } 
-    if (forpipeline->list) {
-        AST_FreeList(forpipeline->list);
-    } 
-
-    free(forpipeline);
+    return VM_Run(program);
 }
 
-void AST_FreeTickPipeline(AST_Pipeline_t *tickpipeline)
-{
-    free(tickpipeline);
-}
+/****************************************************************************/
 
-void AST_FreeWhilePipeline(AST_WhilePipeline_t *whilepipeline)
+/* Take the arena the program was built in off the parser, so the program
+ * can outlive the parse. Everything the program uses has to be in it */
+int AST_DetachProgram(AST_Program_t *program)
 {
-    if (whilepipeline->test) {
-        AST_FreeList(whilepipeline->test);
-    }
-    if (whilepipeline->list) {
-        AST_FreeList(whilepipeline->list);
-    }
-    free(whilepipeline);
-}
+    Arena_t *arena;
 
-void AST_FreePipeline(AST_Pipeline_t *pipeline)
-{
-    if (pipeline->assignment) {
-        AST_FreeAssignment(pipeline->assignment);
-    } 
-    if (pipeline->expression) {
-        AST_FreeExpression(pipeline->expression);
-    }
-    if (pipeline->ifpipeline) {
-        AST_FreeIfPipeline(pipeline->ifpipeline);
-    }
-    if (pipeline->forpipeline) {
-        AST_FreeForPipeline(pipeline->forpipeline);
+    if ((arena = malloc(sizeof(*arena))) == NULL) {
+        return -ENOMEM;
     }
-    if (pipeline->tickpipeline) {
-        AST_FreeTickPipeline(pipeline->tickpipeline);
-    }
-    if (pipeline->whilepipeline) {
-        AST_FreeWhilePipeline(pipeline->whilepipeline);
-    }
-    free(pipeline);
+    *arena = *program->arena;
+    memset(program->arena, 0, sizeof(*program->arena));
+
+    program->arena    = arena;
+    program->detached = true;
+
+    return 0;
 }
 
-void AST_FreeList(AST_List_t *list)
+/* Everything in the program came from its arena */
+void AST_FreeProgram(AST_Program_t *program)
 {
-    int i;
+    Arena_t *arena = program->arena;
 
-    for (i = 0; i < list->npipelines; i++) {
-        AST_FreePipeline(list->pipelines[i]);
+    if (program->detached) {
+        Arena_Free(arena);
+        free(arena);
+    } else {
+        Arena_Reset(arena);
     }
-    free(list->pipelines);
-    free(list);
 }
 
 //------------------------------------------------------------------------------
-
@@ -15,6 +15,10 @@
 #include <ctype.h>
 #include <stdbool.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <libraries/parser.h>
 
 #if USE_DTRACE
@@ -27,6 +31,15 @@
  *                              T Y P E S
  ****************************************************************************/
 
+/* Character classes */
+enum {
+    CLASS_WORD    = 0x01,
+    CLASS_CONTROL = 0x02,
+    CLASS_SPACE   = 0x04,   /* isspace() */
+    CLASS_BLANK   = 0x08,   /* Spaces that can never end a line */
+    CLASS_EOL     = 0x10,   /* Characters that end a comment */
+};
+
 /*****************************************************************************
  *                 F U N C T I O N     P R O T O T Y P E S
  ****************************************************************************/
@@ -40,9 +53,62 @@ char *my_getenv(char *name);
  ****************************************************************************/
 typedef struct {
     const char        *keyword;
+    const int          len;
     const Token_Type_t type;
 } Scanner_Keyword_t;
 
+/* Perfect hash of the keywords on their first and last characters */
+#define KEYWORD_HASH(first, last) \
+    (((unsigned char) (first) + 6*(unsigned char) (last)) & 31)
+
+static const Scanner_Keyword_t keywords[32] = {
+    [KEYWORD_HASH('i', 'f')] = {"if",       2, TOKEN_IF},
+    [KEYWORD_HASH('t', 'n')] = {"then",     4, TOKEN_THEN},
+    [KEYWORD_HASH('e', 'e')] = {"else",     4, TOKEN_ELSE},
+    [KEYWORD_HASH('e', 'f')] = {"elif",     4, TOKEN_ELIF},
+    [KEYWORD_HASH('f', 'i')] = {"fi",       2, TOKEN_FI},
+    [KEYWORD_HASH('f', 'r')] = {"for",      3, TOKEN_FOR},
+    [KEYWORD_HASH('i', 'n')] = {"in",       2, TOKEN_IN},
+    [KEYWORD_HASH('c', 'e')] = {"continue", 8, TOKEN_CONTINUE},
+    [KEYWORD_HASH('b', 'k')] = {"break",    5, TOKEN_BREAK},
+    [KEYWORD_HASH('w', 'e')] = {"while",    5, TOKEN_WHILE},
+    [KEYWORD_HASH('d', 'o')] = {"do",       2, TOKEN_DO},
+    [KEYWORD_HASH('d', 'e')] = {"done",     4, TOKEN_DONE},
+};
+
+static const unsigned char Scanner_Class[256] = {
+    ['0' ... '9'] = CLASS_WORD,
+    ['A' ... 'Z'] = CLASS_WORD,
+    ['a' ... 'z'] = CLASS_WORD,
+    ['_']  = CLASS_WORD,
+    ['-']  = CLASS_WORD,
+    ['.']  = CLASS_WORD,
+    ['/']  = CLASS_WORD,
+    ['?']  = CLASS_WORD,
+    ['!']  = CLASS_WORD,
+    ['@']  = CLASS_WORD,
+    ['#']  = CLASS_WORD,
+    ['%']  = CLASS_WORD,
+    ['^']  = CLASS_WORD,
+    ['&']  = CLASS_WORD | CLASS_CONTROL,
+    ['(']  = CLASS_WORD,
+    [')']  = CLASS_WORD,
+    ['[']  = CLASS_WORD,
+    [']']  = CLASS_WORD,
+    ['+']  = CLASS_WORD,
+    ['>']  = CLASS_CONTROL,
+    ['<']  = CLASS_CONTROL,
+    ['$']  = CLASS_CONTROL,
+    ['|']  = CLASS_CONTROL,
+    [' ']  = CLASS_SPACE | CLASS_BLANK,
+    ['\t'] = CLASS_SPACE | CLASS_BLANK,
+    ['\v'] = CLASS_SPACE | CLASS_BLANK,
+    ['\f'] = CLASS_SPACE | CLASS_BLANK,
+    ['\r'] = CLASS_SPACE | CLASS_EOL,
+    ['\n'] = CLASS_SPACE | CLASS_EOL,
+    ['\0'] = CLASS_EOL,
+};
+
 /****************************************************************************/
 char *_DEBUG_TokenToString(int t) 
 {
@@ -53,6 +119,7 @@ char *_DEBUG_TokenToString(int t)
         case TOKEN_ID:         return "TOKEN_ID";
         case TOKEN_DOLLAR:     return "TOKEN_DOLLAR";
         case TOKEN_STRING:     return "TOKEN_STRING";
+        case TOKEN_ARITH:      return "TOKEN_ARITH";
 
         case TOKEN_IF:         return "TOKEN_IF";
         case TOKEN_THEN:       return "TOKEN_THEN";
@@ -77,72 +144,250 @@ char *_DEBUG_TokenToString(int t)
         case TOKEN_TICK:       return "TOKEN_TICK";
         case TOKEN_PIPE:       return "TOKEN_PIPE";
         case TOKEN_NEWLINE:    return "TOKEN_NEWLINE";
+        case TOKEN_APPEND:     return "TOKEN_APPEND";
+        case TOKEN_DUP:        return "TOKEN_DUP";
 
         case TOKEN_ERROR:      return "TOKEN_ERROR";
         default:               return "TOKEN_UNKNOWN";
     }
 }
 
+/* Returns the keyword type of a word, or TOKEN_ID if it is not one */
+static Token_Type_t Scanner_Keyword(const char *word, int len)
+{
+    const Scanner_Keyword_t *k;
+
+    if (len < 2) {
+        return TOKEN_ID;
+    }
+
+    k = &keywords[KEYWORD_HASH(word[0], word[len-1])];
+    if (k->len == len && memcmp(word, k->keyword, len) == 0) {
+        return k->type;
+    }
+
+    return TOKEN_ID;
+}
+
+/* Operators always read the same, so share a constant string for them */
+static char *Scanner_TokenString(Token_Type_t type)
+{
+    switch (type) {
+        case TOKEN_EOF:        return "";
+        case TOKEN_AND:        return "&";
+        case TOKEN_ANDAND:     return "&&";
+        case TOKEN_OROR:       return "||";
+        case TOKEN_EQUALS:     return "=";
+        case TOKEN_SEMICOLON:  return ";";
+        case TOKEN_PIPE:       return "|";
+        case TOKEN_NEWLINE:    return "\n";
+        default:               return NULL;
+    }
+}
+
 int iswordchar(char c)
 {
-    return ((isalnum(c)) || 
-            (c == '_')   || 
-            (c == '-')   ||
-            (c == '.')   || 
-            (c == '/')   ||
-            (c == '?')   ||
-            (c == '!')   ||
-            (c == '@')   ||
-            (c == '#')   ||
-            (c == '%')   ||
-            (c == '^')   ||
-            (c == '&')   ||
-            (c == '(')   ||
-            (c == ')')   ||
-            (c == '[')   ||
-            (c == ']')   ||
-            (c == '+'));
+    return (Scanner_Class[(unsigned char) c] & CLASS_WORD);
 }
 
 int iscontrolchar(char c)
 {
-    return ((c == '&') || (c == '>') || (c == '<') || (c == '$') || (c == '|'));
+    return (Scanner_Class[(unsigned char) c] & CLASS_CONTROL);
 }
 
+#if defined(__SSE2__)
+/* Bit mask of which of the 16 characters in x are in the class */
+static inline unsigned int Scanner_ClassMask(__m128i x, unsigned char class)
+{
+    __m128i in;
 
+    switch (class) {
+        case CLASS_WORD:
+        {
+            /* Everything from '!' to 'z' bar a few punctuation characters */
+            __m128i d    = _mm_sub_epi8(x, _mm_set1_epi8('!'));
+            __m128i punc = _mm_sub_epi8(x, _mm_set1_epi8(':'));
+
+            in = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8('z' - '!')), d);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_min_epu8(punc, _mm_set1_epi8('>' - ':')), punc), in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),  in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('$')),  in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\'')), in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('*')),  in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(',')),  in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\\')), in);
+            in = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('`')),  in);
+            break;
+        }
+        case CLASS_BLANK:
+            in = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\v')),
+                                 _mm_cmpeq_epi8(x, _mm_set1_epi8('\f'))));
+            break;
+
+        case CLASS_EOL:
+            in = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+                    _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\r')),
+                                 _mm_cmpeq_epi8(x, _mm_setzero_si128())));
+            break;
+
+        default:
+            return 0;
+    }
+
+    return _mm_movemask_epi8(in);
+}
+#endif /* __SSE2__ */
+
+/* Length of the run of characters at the start of s that are in the class, or
+ * with until set the length of the run up to the first one that is */
+static inline size_t Scanner_Span(const char *s, size_t n, unsigned char class, bool until)
+{
+    size_t       i     = 0;
+    unsigned int match = until ? 0 : 1;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        unsigned int mask;
+
+        mask = Scanner_ClassMask(_mm_loadu_si128((const __m128i *) &s[i]), class);
+        if (!until) {
+            mask = ~mask & 0xffff;
+        }
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif /* __SSE2__ */
+
+    while ((i < n) && (!!(Scanner_Class[(unsigned char) s[i]] & class) == match)) {
+        i++;
+    }
+
+    return i;
+}
+
+/* Make sure at least n unread characters are held in the lookahead window */
+static void Scanner_Fill(Parser_t *parser, size_t n)
+{
+    /* A mapped script is already entirely in the window */
+    if (parser->line_eof) {
+        return;
+    }
+
+    /* Slide the few unread characters back to the start once we run out of
+     * room, this only happens once per window so advancing stays O(1) */
+    if ((parser->line_tail == sizeof(parser->line)) ||
+            (parser->line_head + n > sizeof(parser->line))) {
+        size_t unread = parser->line_tail - parser->line_head;
+
+        memmove(parser->line, &(parser->line[parser->line_head]), unread);
+        parser->line_head = 0;
+        parser->line_tail = unread;
+    }
+
+    /* Read ahead to the end of the line, so runs of characters can be scanned
+     * in one go without waiting on input past the line */
+    while (parser->line_tail < sizeof(parser->line)) {
+        int c = parser->getchar(parser, 1000);
+
+        if (c == EOF) {
+            /* Keep returning the end of input without asking again */
+            parser->line_eof = true;
+            break;
+        }
+        parser->line[parser->line_tail++] = c;
+
+        if ((c == '\n') && (parser->line_tail - parser->line_head >= n)) {
+            break;
+        }
+    }
+}
+
+/* Look n characters past the current one without consuming them */
 char Scanner_Inspect(Parser_t *parser, int n)
 {
-    if (n >= strlen(parser->line)) {
-        int i;
-        for (i = 1; i <= n; i++) {
-            parser->line[i] = parser->getchar(parser, 1000);
+    if (parser->line_tail - parser->line_head < n) {
+        Scanner_Fill(parser, n);
+
+        if (parser->line_tail - parser->line_head < n) {
+            return '\0';
         }
-    } 
+    }
+
+    return parser->input[parser->line_head + n - 1];
+}
+
+/* Append to the copy of the token, anything that doesn't fit is dropped */
+static void Scanner_TokenCopy(Parser_t *parser, const char *s, size_t n)
+{
+    size_t room = sizeof(parser->token) - 1 - parser->token_idx;
 
-    return parser->line[n];
+    if (n > room) {
+        n = room;
+    }
+    memcpy(&(parser->token[parser->token_idx]), s, n);
+    parser->token_idx += n;
+    parser->token[parser->token_idx] = '\0';
+}
+
+/* Copy a token that has been tracked as a slice of the input */
+static void Scanner_TokenUnslice(Parser_t *parser)
+{
+    size_t n = parser->token_idx;
+
+    parser->token_slice = false;
+    parser->token_idx   = 0;
+    Scanner_TokenCopy(parser, &(parser->input[parser->token_start]), n);
 }
 
 void Scanner_TokenAppend(Parser_t *parser, char c)
 {
-    parser->token[parser->token_idx++] = c;
+    if (parser->token_slice) {
+        /* The token no longer follows on in the input, take a copy */
+        Scanner_TokenUnslice(parser);
+    }
+
+    Scanner_TokenCopy(parser, &c, 1);
+}
+
+/* Add the current character to the token */
+static void Scanner_TokenStore(Parser_t *parser)
+{
+    size_t pos = parser->line_head - 1;
+
+    if (parser->token_slice && parser->token_idx == 0) {
+        parser->token_start = pos;
+    }
+
+    /* Mapped input only needs the slice extended */
+    if (parser->token_slice && 
+            (parser->token_start + parser->token_idx == pos) &&
+            (pos != parser->token_clobbered)) {
+        parser->token_idx++;
+    } else {
+        Scanner_TokenAppend(parser, parser->c);
+    }
 }
 
 char Scanner_Accept(Parser_t *parser, bool store_char)
 {
     if (store_char == STORE_CHAR) {
         /* Store the character */
-        Scanner_TokenAppend(parser, parser->c);
+        Scanner_TokenStore(parser);
     }
 
     /* Grab the next one */
-    if (strlen(parser->line) == 0) {
-        parser->line[0] = parser->getchar(parser, 1000);
+    if (parser->line_head == parser->line_tail) {
+        Scanner_Fill(parser, 1);
+    }
+    if (parser->line_head < parser->line_tail) {
+        parser->c = parser->input[parser->line_head++];
+    } else {
+        parser->c = '\0';
     }
-
-    /* Move all the characters up one */
-    parser->c = parser->line[0];
-    memmove(parser->line, &(parser->line[1]), sizeof(parser->line)-1);
-    parser->line[sizeof(parser->line)-1] = 0;
 
     /* Update line and column numbers */
     if (((parser->c == '\r') && Scanner_Inspect(parser, 1) != '\n') || 
@@ -156,6 +401,56 @@ char Scanner_Accept(Parser_t *parser, bool store_char)
     return parser->c;
 }
 
+/* Setup the input window and load the first character. Streamed input comes
+ * through parser->getchar, otherwise parser->input holds the whole script. */
+void Scanner_Start(Parser_t *parser)
+{
+    if (parser->getchar) {
+        parser->input     = parser->line;
+        parser->line_tail = 0;
+        parser->line_eof  = false;
+    } else {
+        parser->line_tail = parser->input_len;
+        parser->line_eof  = true;
+    }
+    parser->line_head       = 0;
+    parser->token_clobbered = (size_t) -1;
+
+    if (parser->line_head == parser->line_tail) {
+        Scanner_Fill(parser, 1);
+    }
+    if (parser->line_head < parser->line_tail) {
+        parser->c = parser->input[parser->line_head++];
+    } else {
+        parser->c = '\0';
+    }
+}
+
+/* Accept the current character along with the n that follow it in the
+ * window, none of which may be line breaks */
+static void Scanner_AcceptRun(Parser_t *parser, size_t n, bool store_char)
+{
+    if (store_char == STORE_CHAR) {
+        Scanner_TokenStore(parser);
+
+        if (parser->token_slice) {
+            parser->token_idx += n;
+        } else {
+            Scanner_TokenCopy(parser, &(parser->input[parser->line_head]), n);
+        }
+    }
+
+    parser->line_head += n;
+    parser->colnum    += n;
+
+    Scanner_Accept(parser, IGNORE_CHAR);
+}
+
+/* Length of the run in the unread part of the window */
+#define Scanner_WindowSpan(parser, class, until) \
+    Scanner_Span(&((parser)->input[(parser)->line_head]), \
+            (parser)->line_tail - (parser)->line_head, class, until)
+
 void Scanner_ScanNumber(Parser_t *parser)
 {
     while (isdigit(parser->c)) {
@@ -166,65 +461,72 @@ void Scanner_ScanNumber(Parser_t *parser)
 void Scanner_ScanWord(Parser_t *parser)
 {
     while (iswordchar(parser->c)) {
+        Scanner_AcceptRun(parser, 
+                Scanner_WindowSpan(parser, CLASS_WORD, false), STORE_CHAR);
+    }
+}
+
+/* One of > >> >& < <&, after any fd number */
+static Token_Type_t Scanner_ScanRedirect(Parser_t *parser)
+{
+    Token_Type_t type = (parser->c == '>') ? TOKEN_RIGHTARROW : TOKEN_LEFTARROW;
+
+    Scanner_Accept(parser, STORE_CHAR);
+
+    if ((type == TOKEN_RIGHTARROW) && (parser->c == '>')) {
+        Scanner_Accept(parser, STORE_CHAR);
+        type = TOKEN_APPEND;
+    } else if (parser->c == '&') {
         Scanner_Accept(parser, STORE_CHAR);
+        type = TOKEN_DUP;
     }
+
+    return type;
 }
 
 void Scanner_SkipComments(Parser_t *parser)
 {
-    while ((isspace(parser->c) || parser->c == '#') && (parser->c != '\n')) {
+    while ((Scanner_Class[(unsigned char) parser->c] & CLASS_SPACE) || 
+            (parser->c == '#')) {
+        if (parser->c == '\n') {
+            break;
+        }
+
         /* Skip any leading whitespace */
-        while (isspace(parser->c) && parser->c != '\n') {
-            Scanner_Accept(parser, IGNORE_CHAR);
+        while ((Scanner_Class[(unsigned char) parser->c] & CLASS_SPACE) &&
+                (parser->c != '\n')) {
+            Scanner_AcceptRun(parser, 
+                    Scanner_WindowSpan(parser, CLASS_BLANK, false), IGNORE_CHAR);
         }
 
         /* Skip any comments */
         if (parser->c == '#') {
             /* Find the end of line */
             while ((parser->c != '\n') && (parser->c != '\0')) {
-                Scanner_Accept(parser, IGNORE_CHAR);
+                Scanner_AcceptRun(parser, 
+                        Scanner_WindowSpan(parser, CLASS_EOL, true), IGNORE_CHAR);
             }
         }
     }
 }
 
-void Scanner_TokenFree(Token_t *t) 
-{
-    if (t) {
-        if (t->str) {
-            free(t->str);
-        }
-        free(t);
-    }
-}
-
 Token_t *Scanner_TokenNext(Parser_t *parser)
 {
     Token_t     *token = NULL;
     Token_Type_t type;
     bool         control = false;
+    bool         blank;
 
-    const Scanner_Keyword_t keywords[] = {
-        {"if",          TOKEN_IF},
-        {"then",        TOKEN_THEN},
-        {"else",        TOKEN_ELSE},
-        {"elif",        TOKEN_ELIF},
-        {"fi",          TOKEN_FI},
-        {"for",         TOKEN_FOR},
-        {"in",          TOKEN_IN},
-        {"continue",    TOKEN_CONTINUE},
-        {"break",       TOKEN_BREAK},
-        {"while",       TOKEN_WHILE},
-        {"do",          TOKEN_DO},
-        {"done",        TOKEN_DONE},
-    };
+    /* Whether the token stands apart from the one before it */
+    blank = (Scanner_Class[(unsigned char) parser->c] & CLASS_SPACE) != 0;
 
     Scanner_SkipComments(parser);
 
     parser->token_startline = parser->linenum;
     parser->token_startcol  = parser->colnum;
     parser->token_idx       = 0;
-    memset(parser->token, 0, sizeof(parser->token));
+    parser->token[0]        = '\0';
+    parser->token_slice     = (parser->getchar == NULL);
 
     switch (parser->c) {
         case '&':
@@ -257,13 +559,8 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
 #endif
 
         case '>':
-            Scanner_Accept(parser, STORE_CHAR);
-            type = TOKEN_RIGHTARROW;
-            break;
-
         case '<':
-            Scanner_Accept(parser, STORE_CHAR);
-            type = TOKEN_LEFTARROW;
+            type = Scanner_ScanRedirect(parser);
             break;
 
         case '$':
@@ -272,6 +569,36 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
 
             Scanner_Accept(parser, IGNORE_CHAR);
 
+            /* $(( expression )), keep the expression for the compiler */
+            if ((parser->c == '(') && (Scanner_Inspect(parser, 1) == '(')) {
+                int depth = 0;
+
+                Scanner_Accept(parser, IGNORE_CHAR);
+                Scanner_Accept(parser, IGNORE_CHAR);
+
+                while (parser->c != '\0') {
+                    if (parser->c == '(') {
+                        depth++;
+                    } else if (parser->c == ')') {
+                        if ((depth == 0) && (Scanner_Inspect(parser, 1) == ')')) {
+                            break;
+                        }
+                        depth--;
+                    }
+                    Scanner_Accept(parser, STORE_CHAR);
+                }
+
+                if (parser->c == '\0') {
+                    type = TOKEN_ERROR;
+                    break;
+                }
+                Scanner_Accept(parser, IGNORE_CHAR);
+                Scanner_Accept(parser, IGNORE_CHAR);
+
+                type = TOKEN_ARITH;
+                break;
+            }
+
             if (parser->c == '{') {
                 require_bracket = true;
                 Scanner_Accept(parser, IGNORE_CHAR);
@@ -298,7 +625,14 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
 
         case '=':
             Scanner_Accept(parser, STORE_CHAR);
-            type = TOKEN_EQUALS;
+
+            /* Only name=value assigns, a lone = is a word as in [ a = b ] */
+            if (blank) {
+                Scanner_ScanWord(parser);
+                type = TOKEN_ID;
+            } else {
+                type = TOKEN_EQUALS;
+            }
             break;
 
         case ';':
@@ -359,7 +693,7 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
         case '`':
             Scanner_Accept(parser, IGNORE_CHAR);
 
-            while (parser->c != '`') {
+            while ((parser->c != '`') && (parser->c != '\0')) {
                 Scanner_Accept(parser, STORE_CHAR);
             }
 
@@ -395,19 +729,35 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
 
         default:
             if (iswordchar(parser->c)) {
-                int i;
+                const char *word;
 
                 Scanner_ScanWord(parser);
                 type = TOKEN_ID;
 
+                word = parser->token_slice ? &(parser->input[parser->token_start]) : parser->token;
+
+                /* The fd of a redirection, as in 2>&1 */
+                if (((parser->c == '>') || (parser->c == '<')) &&
+                        (strspn(word, "0123456789") >= parser->token_idx)) {
+                    type = Scanner_ScanRedirect(parser);
+                    break;
+                }
+
+                /* != is one word */
+                if ((parser->c == '=') && (parser->token_idx == 1) &&
+                        ((parser->token_slice ? parser->input[parser->token_start] :
+                          parser->token[0]) == '!')) {
+                    Scanner_Accept(parser, STORE_CHAR);
+                }
+
                 if (parser->token_control) {
-                    /* Search to see if it is a keyword */
-                    for (i = 0; i < countof(keywords); i++) {
-                        if (strcmp(parser->token, keywords[i].keyword) == 0) {
-                            type =  keywords[i].type;
-                            break;
-                        }
+                    const char *word = parser->token;
+
+                    if (parser->token_slice) {
+                        word = &(parser->input[parser->token_start]);
                     }
+
+                    type = Scanner_Keyword(word, parser->token_idx);
                 }
 
             } else {
@@ -417,13 +767,27 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
     }
 
     /* Allocate the token */
-    if ((token = calloc(1, sizeof(*token))) == NULL) {
-        goto fail;
+    if ((token = Arena_Alloc(parser->arena, sizeof(*token))) == NULL) {
+        return NULL;
     }
+    token->len = parser->token_idx;
+
+    if (parser->token_slice && (parser->token_idx > 0) &&
+            (parser->token_start + parser->token_idx < parser->line_head)) {
+        /* Point straight into the mapped script, the terminator has already
+         * been consumed so it can be overwritten */
+        token->str    = &(parser->input[parser->token_start]);
+        token->str[token->len] = '\0';
+        parser->token_clobbered = parser->token_start + token->len;
+    } else if ((token->str = Scanner_TokenString(type)) == NULL) {
+        if (parser->token_slice) {
+            Scanner_TokenUnslice(parser);
+        }
 
-    /* Take a copy of the string */
-    if (((token->str = strdup(parser->token))) == NULL) {
-        goto fail;
+        /* Take a copy of the string */
+        if ((token->str = Arena_Strndup(parser->arena, parser->token, token->len)) == NULL) {
+            return NULL;
+        }
     }
     token->type    = type;
     token->control = control;
@@ -443,16 +807,6 @@ Token_t *Scanner_TokenNext(Parser_t *parser)
     }
 
     return token;
-
-fail:
-    if (token) {
-        if (token->str) {
-            free(token->str);
-        }
-        free(token);
-    }
-
-    return NULL;
 }
 
 void Scanner_TokenAccept(Parser_t *parser)
@@ -460,9 +814,9 @@ void Scanner_TokenAccept(Parser_t *parser)
     parser->t = Scanner_TokenNext(parser);
 }
 
+/* The consumed token stays in the arena until the program is freed */
 void Scanner_TokenConsume(Parser_t *parser)
 {
-    Scanner_TokenFree(parser->t);
     Scanner_TokenAccept(parser);
 }
 
@@ -0,0 +1,380 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       parser_test.c
+//  Description:    Compiles [ ... ] commands into predicates
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+typedef struct {
+    AST_Program_t *program;
+    AST_Command_t *command;
+    uint32_t       i;           /* Next word of the command */
+    uint32_t       end;         /* The closing ] */
+} Test_Parser_t;
+
+typedef struct {
+    const char *name;
+    Test_Op_t   op;
+} Test_Operator_t;
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+char *Shell_VarGet(int slot);
+int Shell_VarGetNum(int slot, long *num);
+
+static int Test_ParseOr(Test_Parser_t *parser);
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+static const Test_Operator_t unary_operators[] = {
+    {"-n", TEST_STRING},
+    {"-z", TEST_EMPTY},
+    {"-e", TEST_EXISTS},
+    {"-f", TEST_FILE},
+    {"-d", TEST_DIR},
+    {"-h", TEST_SYMLINK},
+    {"-L", TEST_SYMLINK},
+    {"-r", TEST_READ},
+    {"-w", TEST_WRITE},
+    {"-x", TEST_EXEC},
+    {"-s", TEST_SIZE},
+    {NULL},
+};
+
+static const Test_Operator_t binary_operators[] = {
+    {"=",   TEST_STREQ},
+    {"!=",  TEST_STRNE},
+    {"-eq", TEST_EQ},
+    {"-ne", TEST_NE},
+    {"-lt", TEST_LT},
+    {"-le", TEST_LE},
+    {"-gt", TEST_GT},
+    {"-ge", TEST_GE},
+    {NULL},
+};
+
+/****************************************************************************/
+/* Operators have to be written out, a $var is only ever an operand */
+static const char *Test_Word(Test_Parser_t *parser, uint32_t k)
+{
+    if (parser->i + k >= parser->end) {
+        return NULL;
+    }
+
+    return parser->command->args[parser->i + k];
+}
+
+static bool Test_Is(Test_Parser_t *parser, const char *word)
+{
+    const char *w = Test_Word(parser, 0);
+
+    return w && (strcmp(w, word) == 0);
+}
+
+/* Returns the operator for word k if it is in the table, or -1 */
+static int Test_Operator(Test_Parser_t *parser, uint32_t k, const Test_Operator_t *operators)
+{
+    const char *w = Test_Word(parser, k);
+
+    for (; w && operators->name; operators++) {
+        if (strcmp(w, operators->name) == 0) {
+            return operators->op;
+        }
+    }
+
+    return -1;
+}
+
+/* Take the next word as an operand */
+static int Test_Operand(Test_Parser_t *parser)
+{
+    AST_Program_t  *program = parser->program;
+    AST_Command_t  *command = parser->command;
+    Test_Operand_t *operands;
+    Test_Operand_t *operand;
+    uint32_t        i = parser->i++;
+    char           *end = NULL;
+
+    if ((operands = Arena_Grow(program->arena, program->operands,
+                    program->noperands, sizeof(*operands))) == NULL) {
+        return -ENOMEM;
+    }
+    program->operands = operands;
+    operand = &operands[program->noperands];
+
+    operand->slot  = command->slots ? command->slots[i] : -1;
+    operand->arith = command->ariths ? command->ariths[i] : AST_NONE;
+    operand->str   = command->args[i];
+    operand->num   = operand->str ? strtol(operand->str, &end, 0) : 0;
+    operand->nan   = !operand->str || end == operand->str || *end != '\0';
+
+    return program->noperands++;
+}
+
+static int Test_Node(Test_Parser_t *parser, Test_Op_t op, int left, int right)
+{
+    AST_Program_t *program = parser->program;
+    Test_Node_t   *tests;
+
+    if (left < 0 || right < 0) {
+        return -EINVAL;
+    }
+
+    if ((tests = Arena_Grow(program->arena, program->tests,
+                    program->ntests, sizeof(*tests))) == NULL) {
+        return -ENOMEM;
+    }
+    program->tests = tests;
+
+    tests[program->ntests].op    = op;
+    tests[program->ntests].left  = left;
+    tests[program->ntests].right = right;
+
+    return program->ntests++;
+}
+
+static int Test_ParsePrimary(Test_Parser_t *parser)
+{
+    int test;
+    int op;
+    int left;
+
+    if (Test_Is(parser, "(")) {
+        parser->i++;
+        test = Test_ParseOr(parser);
+        if (!Test_Is(parser, ")")) {
+            return -EINVAL;
+        }
+        parser->i++;
+        return test;
+    }
+
+    /* With three words left x = y is a comparison whatever x is */
+    if (parser->i + 2 < parser->end) {
+        if ((op = Test_Operator(parser, 1, binary_operators)) >= 0) {
+            left = Test_Operand(parser);
+            parser->i++;
+            return Test_Node(parser, op, left, Test_Operand(parser));
+        }
+    }
+
+    if ((parser->i + 1 < parser->end) &&
+            (op = Test_Operator(parser, 0, unary_operators)) >= 0) {
+        parser->i++;
+        return Test_Node(parser, op, Test_Operand(parser), 0);
+    }
+
+    if (parser->i < parser->end) {
+        return Test_Node(parser, TEST_STRING, Test_Operand(parser), 0);
+    }
+
+    return -EINVAL;
+}
+
+static int Test_ParseNot(Test_Parser_t *parser)
+{
+    if (Test_Is(parser, "!") && (parser->i + 1 < parser->end)) {
+        parser->i++;
+        return Test_Node(parser, TEST_NOT, Test_ParseNot(parser), 0);
+    }
+
+    return Test_ParsePrimary(parser);
+}
+
+static int Test_ParseAnd(Test_Parser_t *parser)
+{
+    int test = Test_ParseNot(parser);
+
+    while (test >= 0 && Test_Is(parser, "-a")) {
+        parser->i++;
+        test = Test_Node(parser, TEST_AND, test, Test_ParseNot(parser));
+    }
+
+    return test;
+}
+
+static int Test_ParseOr(Test_Parser_t *parser)
+{
+    int test = Test_ParseAnd(parser);
+
+    while (test >= 0 && Test_Is(parser, "-o")) {
+        parser->i++;
+        test = Test_Node(parser, TEST_OR, test, Test_ParseAnd(parser));
+    }
+
+    return test;
+}
+
+/* Compile a [ ... ] command. Returns the test, or a negative number when the
+ * command is something else or does not make sense, and is left to run as a
+ * builtin */
+int Test_Compile(AST_Program_t *program, AST_Command_t *command)
+{
+    Test_Parser_t parser;
+    int           test;
+
+    if (command->argc < 3 || command->background ||
+            !command->args[0] || strcmp(command->args[0], "[") != 0 ||
+            !command->args[command->argc - 1] ||
+            strcmp(command->args[command->argc - 1], "]") != 0) {
+        return -EINVAL;
+    }
+
+    parser.program = program;
+    parser.command = command;
+    parser.i       = 1;
+    parser.end     = command->argc - 1;
+
+    if ((test = Test_ParseOr(&parser)) < 0 || parser.i != parser.end) {
+        DTRACE("%s: Left to the builtin\n", __func__);
+        return -EINVAL;
+    }
+
+    return test;
+}
+
+/****************************************************************************/
+/* An operand that can not be worked out sets error and reads as empty */
+static const char *Test_String(AST_Program_t *program, uint32_t operand,
+        char *buf, size_t size, bool *error)
+{
+    const Test_Operand_t *o = &program->operands[operand];
+    const char *value;
+    long num;
+
+    if (o->arith) {
+        num = 0;
+        if (Arith_Eval(program, o->arith, &num) < 0) {
+            *error = true;
+            return "";
+        }
+        snprintf(buf, size, "%ld", num);
+        return buf;
+    } else if (o->slot >= 0) {
+        return (value = Shell_VarGet(o->slot)) ? value : "";
+    }
+
+    return o->str;
+}
+
+static long Test_Int(AST_Program_t *program, uint32_t operand, bool *error)
+{
+    const Test_Operand_t *o = &program->operands[operand];
+    const char *value;
+    long num = 0;
+
+    if (o->arith) {
+        if (Arith_Eval(program, o->arith, &num) < 0) {
+            *error = true;
+            num = 0;
+        }
+    } else if (o->slot >= 0) {
+        if (Shell_VarGetNum(o->slot, &num) < 0) {
+            value = Shell_VarGet(o->slot);
+            fprintf(stderr, "[: %s: integer expression expected\n", value ? value : "");
+            *error = true;
+        }
+    } else if (o->nan) {
+        fprintf(stderr, "[: %s: integer expression expected\n", o->str ? o->str : "");
+        *error = true;
+    } else {
+        num = o->num;
+    }
+
+    return num;
+}
+
+static bool Test_Holds(AST_Program_t *program, uint32_t test, bool *error)
+{
+    const Test_Node_t *node = &program->tests[test];
+    char        a[3*sizeof(long) + 2];
+    char        b[3*sizeof(long) + 2];
+    const char *s;
+    struct stat st;
+
+    switch (node->op) {
+        case TEST_NOT:
+            return !Test_Holds(program, node->left, error);
+        case TEST_AND:
+            return Test_Holds(program, node->left, error) && Test_Holds(program, node->right, error);
+        case TEST_OR:
+            return Test_Holds(program, node->left, error) || Test_Holds(program, node->right, error);
+
+        case TEST_STRING:
+            return Test_String(program, node->left, a, sizeof(a), error)[0] != '\0';
+        case TEST_EMPTY:
+            return Test_String(program, node->left, a, sizeof(a), error)[0] == '\0';
+        case TEST_STREQ:
+            return strcmp(Test_String(program, node->left, a, sizeof(a), error),
+                    Test_String(program, node->right, b, sizeof(b), error)) == 0;
+        case TEST_STRNE:
+            return strcmp(Test_String(program, node->left, a, sizeof(a), error),
+                    Test_String(program, node->right, b, sizeof(b), error)) != 0;
+
+        case TEST_EQ:
+            return Test_Int(program, node->left, error) == Test_Int(program, node->right, error);
+        case TEST_NE:
+            return Test_Int(program, node->left, error) != Test_Int(program, node->right, error);
+        case TEST_LT:
+            return Test_Int(program, node->left, error) <  Test_Int(program, node->right, error);
+        case TEST_LE:
+            return Test_Int(program, node->left, error) <= Test_Int(program, node->right, error);
+        case TEST_GT:
+            return Test_Int(program, node->left, error) >  Test_Int(program, node->right, error);
+        case TEST_GE:
+            return Test_Int(program, node->left, error) >= Test_Int(program, node->right, error);
+
+        default:
+            break;
+    }
+
+    /* File tests */
+    s = Test_String(program, node->left, a, sizeof(a), error);
+
+    switch (node->op) {
+        case TEST_EXISTS:  return stat(s, &st) == 0;
+        case TEST_FILE:    return (stat(s, &st) == 0) && S_ISREG(st.st_mode);
+        case TEST_DIR:     return (stat(s, &st) == 0) && S_ISDIR(st.st_mode);
+        case TEST_SYMLINK: return (lstat(s, &st) == 0) && S_ISLNK(st.st_mode);
+        case TEST_SIZE:    return (stat(s, &st) == 0) && (st.st_size > 0);
+        case TEST_READ:    return access(s, R_OK) == 0;
+        case TEST_WRITE:   return access(s, W_OK) == 0;
+        case TEST_EXEC:    return access(s, X_OK) == 0;
+        default:           return false;
+    }
+}
+
+/* The status [ ... ] has, 2 when an operand could not be worked out */
+int Test_Eval(AST_Program_t *program, uint32_t test)
+{
+    bool error = false;
+    bool holds = Test_Holds(program, test, &error);
+
+    return error ? 2 : (holds ? 0 : 1);
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,623 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       parser_vm.c
+//  Description:    Compiles the AST to bytecode and runs it
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+/* The body of a parallel for, run once for each of its words */
+typedef struct {
+    AST_Program_t     *program;
+    AST_ForPipeline_t *forpipeline;
+    uint32_t           pc;
+} VM_Loop_t;
+
+/* Where a background loop starts running */
+typedef struct {
+    AST_Program_t *program;
+    uint32_t       pc;
+    void          *vars;        /* A copy of the variables as it started */
+} VM_Task_t;
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+int Shell_VarSlot(const char *name);
+int Shell_VarSet(int slot, const char *value);
+int Shell_VarSetInt(int slot, long num);
+Builtin_Func_t Shell_BuiltinLookup(const char *name);
+int Shell_ForEach(uint32_t n, uint32_t nworkers, int (*func)(void *arg, uint32_t i), void *arg);
+void *Shell_Snapshot(void);
+void Shell_SnapshotFree(void *snapshot);
+int Shell_SnapshotRun(void *snapshot, int (*func)(void *arg), void *arg);
+
+static int VM_CompileList(AST_Program_t *program, AST_Index_t list, int depth);
+static int VM_CompilePipeline(AST_Program_t *program, AST_Index_t pipeline, int depth);
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+/* Returns the address of the new op, or -ENOMEM */
+static int VM_Emit(AST_Program_t *program, VM_Opcode_t opcode, uint32_t a, uint32_t b, int c)
+{
+    VM_Op_t *code;
+
+    if ((code = Arena_Grow(program->arena, program->code,
+                    program->ncode, sizeof(*code))) == NULL) {
+        return -ENOMEM;
+    }
+    program->code = code;
+
+    code[program->ncode].op = opcode;
+    code[program->ncode].c  = c;
+    code[program->ncode].a  = a;
+    code[program->ncode].b  = b;
+
+    return program->ncode++;
+}
+
+/* Point the jump at pc at the next op to be emitted */
+static void VM_Patch(AST_Program_t *program, int pc)
+{
+    program->code[pc].a = program->ncode;
+}
+
+/* Everything about a command that does not change between runs is worked
+ * out once, only $var arguments are left to fill in */
+static int VM_CompileCommand(AST_Program_t *program, AST_Command_t *command)
+{
+    uint32_t i;
+
+    if ((command->args = Arena_Alloc(program->arena,
+                    (command->argc + 1) * sizeof(*command->args))) == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < command->argc; i++) {
+        Token_t *arg = program->words[command->argv + i];
+
+        if (arg->type != TOKEN_DOLLAR && arg->type != TOKEN_ARITH) {
+            command->args[i] = arg->str;
+            continue;
+        }
+
+        if (!command->dynamic) {
+            if ((command->slots = Arena_Alloc(program->arena,
+                            command->argc * sizeof(*command->slots))) == NULL) {
+                return -ENOMEM;
+            }
+            memset(command->slots, -1, command->argc * sizeof(*command->slots));
+            command->dynamic = true;
+        }
+
+        if (arg->type == TOKEN_ARITH) {
+            if (!command->ariths && (command->ariths = Arena_Alloc(program->arena,
+                            command->argc * sizeof(*command->ariths))) == NULL) {
+                return -ENOMEM;
+            }
+            if ((command->ariths[i] = Arith_Parse(program, arg->str)) == AST_NONE) {
+                return -EINVAL;
+            }
+            continue;
+        }
+
+        /* Variables are looked up by name once, runs go straight to the slot */
+        if ((command->slots[i] = Shell_VarSlot(arg->str)) < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    for (i = 0; i < command->nredirects; i++) {
+        AST_Redirect_t *redirect = &program->redirects[command->redirects + i];
+
+        if (redirect->target->type == TOKEN_DOLLAR &&
+                (redirect->slot = Shell_VarSlot(redirect->target->str)) < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    if (command->argc > program->maxargc) {
+        program->maxargc = command->argc;
+    }
+
+    /* Literal names are resolved now rather than on every run */
+    if (command->args[0]) {
+        command->builtin = Shell_BuiltinLookup(command->args[0]);
+    }
+
+    return 0;
+}
+
+static int VM_CompilePipe(AST_Program_t *program, AST_Index_t pipe)
+{
+    AST_Pipe_t *node = &(AST_NODE(program, pipe)->pipe);
+    AST_Index_t c;
+
+    node->nargs = 0;
+    for (c = node->first; c != AST_NONE; c = AST_NODE(program, c)->next) {
+        if (VM_CompileCommand(program, &(AST_NODE(program, c)->command)) < 0) {
+            return -ENOMEM;
+        }
+        node->nargs += AST_NODE(program, c)->command.argc;
+    }
+
+    return 0;
+}
+
+/* Commands joined by && and || are evaluated left to right, each operator
+ * jumps past the command following it when the status decides the result */
+static int VM_CompileExpression(AST_Program_t *program, AST_Index_t expression)
+{
+    AST_Index_t e;
+    int         jump = -1;
+
+    for (e = expression; e != AST_NONE; e = AST_NODE(program, e)->expression.expression) {
+        AST_Expression_t *node = &(AST_NODE(program, e)->expression);
+        AST_Command_t    *command;
+        int               test;
+
+        if (AST_NODE(program, node->command)->kind == AST_PIPE) {
+            if (VM_CompilePipe(program, node->command) < 0 ||
+                    VM_Emit(program, OP_PIPE, node->command, 0, 0) < 0) {
+                return -ENOMEM;
+            }
+        } else {
+            command = &(AST_NODE(program, node->command)->command);
+            if (VM_CompileCommand(program, command) < 0) {
+                return -ENOMEM;
+            }
+
+            /* [ ... ] is worked out in the VM rather than run as a command */
+            if ((test = Test_Compile(program, command)) >= 0) {
+                if (VM_Emit(program, OP_TEST, test, 0, 0) < 0) {
+                    return -ENOMEM;
+                }
+            } else if (VM_Emit(program, OP_COMMAND, node->command, 0, 0) < 0) {
+                return -ENOMEM;
+            }
+        }
+        if (jump >= 0) {
+            VM_Patch(program, jump);
+            jump = -1;
+        }
+
+        if (node->op == TOKEN_ANDAND) {
+            jump = VM_Emit(program, OP_JUMP_FALSE, 0, 0, 0);
+        } else if (node->op == TOKEN_OROR) {
+            jump = VM_Emit(program, OP_JUMP_TRUE, 0, 0, 0);
+        } else {
+            continue;
+        }
+
+        if (jump < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+static int VM_CompileIf(AST_Program_t *program, AST_IfPipeline_t *ifpipeline, int depth)
+{
+    int skip;
+    int end = -1;
+
+    if (VM_CompileList(program, ifpipeline->test, depth) < 0) {
+        return -ENOMEM;
+    }
+
+    /* The body is taken when the test succeeds */
+    if ((skip = VM_Emit(program, OP_JUMP_FALSE, 0, 0, 0)) < 0) {
+        return -ENOMEM;
+    }
+    if (VM_CompileList(program, ifpipeline->list, depth) < 0) {
+        return -ENOMEM;
+    }
+
+    if (ifpipeline->elselist) {
+        if ((end = VM_Emit(program, OP_JUMP, 0, 0, 0)) < 0) {
+            return -ENOMEM;
+        }
+        VM_Patch(program, skip);
+
+        if (VM_CompileList(program, ifpipeline->elselist, depth) < 0) {
+            return -ENOMEM;
+        }
+        VM_Patch(program, end);
+    } else {
+        VM_Patch(program, skip);
+    }
+
+    return 0;
+}
+
+static int VM_CompileFor(AST_Program_t *program, AST_Index_t pipeline, int depth)
+{
+    AST_ForPipeline_t *forpipeline = &(AST_NODE(program, pipeline)->forpipeline);
+    int top;
+
+    if ((forpipeline->slot = Shell_VarSlot(forpipeline->var->str)) < 0) {
+        return -ENOMEM;
+    }
+
+    /* Each level of nesting keeps its position in its own loop slot */
+    if (depth + 1 > program->nloops) {
+        program->nloops = depth + 1;
+    }
+
+    /* The body is run on its own for each word, by whichever thread gets it */
+    if (forpipeline->parallel) {
+        if ((top = VM_Emit(program, OP_FOR_PARALLEL, pipeline, 0, 0)) < 0) {
+            return -ENOMEM;
+        }
+        if (VM_CompileList(program, forpipeline->list, depth + 1) < 0) {
+            return -ENOMEM;
+        }
+        if (VM_Emit(program, OP_HALT, 0, 0, 0) < 0) {
+            return -ENOMEM;
+        }
+        program->code[top].b = program->ncode;
+
+        return 0;
+    }
+
+    if (VM_Emit(program, OP_FOR_BEGIN, pipeline, 0, depth) < 0) {
+        return -ENOMEM;
+    }
+    if ((top = VM_Emit(program, OP_FOR_NEXT, pipeline, 0, depth)) < 0) {
+        return -ENOMEM;
+    }
+    if (VM_CompileList(program, forpipeline->list, depth + 1) < 0) {
+        return -ENOMEM;
+    }
+    if (VM_Emit(program, OP_JUMP, top, 0, 0) < 0) {
+        return -ENOMEM;
+    }
+    program->code[top].b = program->ncode;
+
+    return 0;
+}
+
+static int VM_CompileWhile(AST_Program_t *program, AST_WhilePipeline_t *whilepipeline, int depth)
+{
+    int top  = program->ncode;
+    int exit = -1;
+
+    if (whilepipeline->test) {
+        if (VM_CompileList(program, whilepipeline->test, depth) < 0) {
+            return -ENOMEM;
+        }
+        if ((exit = VM_Emit(program, OP_JUMP_FALSE, 0, 0, 0)) < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    if (whilepipeline->list) {
+        if (VM_CompileList(program, whilepipeline->list, depth) < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    if (VM_Emit(program, OP_JUMP, top, 0, 0) < 0) {
+        return -ENOMEM;
+    }
+    if (exit >= 0) {
+        VM_Patch(program, exit);
+    }
+
+    /* A finished while loop is always a success */
+    if (VM_Emit(program, OP_STATUS, 0, 0, 0) < 0) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* The pipeline runs as a task from the op after OP_SPAWN to its own OP_HALT,
+ * while the rest of the program carries on after that */
+static int VM_CompileBackground(AST_Program_t *program, AST_Index_t pipeline, int depth)
+{
+    int spawn;
+    int bang;
+
+    if ((bang = Shell_VarSlot("!")) < 0 ||
+            (spawn = VM_Emit(program, OP_SPAWN, 0, bang, 0)) < 0) {
+        return -ENOMEM;
+    }
+
+    AST_NODE(program, pipeline)->background = false;
+    if (VM_CompilePipeline(program, pipeline, depth) < 0) {
+        return -ENOMEM;
+    }
+    AST_NODE(program, pipeline)->background = true;
+
+    if (VM_Emit(program, OP_HALT, 0, 0, 0) < 0) {
+        return -ENOMEM;
+    }
+    VM_Patch(program, spawn);
+
+    return 0;
+}
+
+static int VM_CompilePipeline(AST_Program_t *program, AST_Index_t pipeline, int depth)
+{
+    AST_Node_t *node = AST_NODE(program, pipeline);
+
+    if (node->background) {
+        return VM_CompileBackground(program, pipeline, depth);
+    }
+
+    switch (node->kind) {
+        case AST_ASSIGNMENT:
+            if ((node->assignment.slot = Shell_VarSlot(node->assignment.var->str)) < 0) {
+                return -ENOMEM;
+            }
+            node->assignment.source = -1;
+            if (node->assignment.value && node->assignment.value->type == TOKEN_DOLLAR &&
+                    (node->assignment.source = Shell_VarSlot(node->assignment.value->str)) < 0) {
+                return -ENOMEM;
+            }
+            if (node->assignment.value && node->assignment.value->type == TOKEN_ARITH) {
+                AST_Index_t arith;
+
+                if ((arith = Arith_Parse(program, node->assignment.value->str)) == AST_NONE) {
+                    return -EINVAL;
+                }
+                AST_NODE(program, pipeline)->assignment.arith = arith;
+            }
+            return (VM_Emit(program, OP_ASSIGN, pipeline, 0, 0) < 0) ? -ENOMEM : 0;
+
+        case AST_EXPRESSION:
+            return VM_CompileExpression(program, pipeline);
+
+        case AST_IF:
+            return VM_CompileIf(program, &(node->ifpipeline), depth);
+
+        case AST_FOR:
+            return VM_CompileFor(program, pipeline, depth);
+
+        case AST_WHILE:
+            return VM_CompileWhile(program, &(node->whilepipeline), depth);
+
+        default:
+            return 0;
+    }
+}
+
+static int VM_CompileList(AST_Program_t *program, AST_Index_t list, int depth)
+{
+    AST_Index_t p;
+
+    p = AST_NODE(program, list)->list.first;
+
+    /* An empty list succeeds */
+    if (p == AST_NONE) {
+        return (VM_Emit(program, OP_STATUS, 0, 0, 0) < 0) ? -ENOMEM : 0;
+    }
+
+    for (; p != AST_NONE; p = AST_NODE(program, p)->next) {
+        if (VM_CompilePipeline(program, p, depth) < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+int VM_Compile(AST_Program_t *program)
+{
+    if ((program->status = Shell_VarSlot("?")) < 0) {
+        return -ENOMEM;
+    }
+    if (VM_CompileList(program, program->list, 0) < 0) {
+        return -ENOMEM;
+    }
+    if (VM_Emit(program, OP_HALT, 0, 0, 0) < 0) {
+        return -ENOMEM;
+    }
+
+    DTRACE("%s: %u ops\n", __func__, program->ncode);
+
+    return 0;
+}
+
+/****************************************************************************/
+static int VM_RunFrom(AST_Program_t *program, uint32_t pc);
+
+static int VM_TaskRun(void *arg)
+{
+    VM_Task_t *task = arg;
+
+    return VM_RunFrom(task->program, task->pc);
+}
+
+/* The last task to finish with a program that has been handed over frees it */
+static int VM_Task(void *arg)
+{
+    VM_Task_t task = *(VM_Task_t *) arg;
+    int       r;
+
+    free(arg);
+
+    r = Shell_SnapshotRun(task.vars, VM_TaskRun, &task);
+
+    if (--task.program->refs == 0 && task.program->detached) {
+        AST_FreeProgram(task.program);
+    }
+
+    return r;
+}
+
+/* Leave the code from pc running as a task, $! in slot bang is its id. Like
+ * a subshell it works on a copy of the variables */
+static int VM_Spawn(AST_Program_t *program, uint32_t pc, int bang)
+{
+    VM_Task_t *task;
+    int        id;
+
+    if ((task = malloc(sizeof(*task))) == NULL) {
+        return -ENOMEM;
+    }
+    task->program = program;
+    task->pc      = pc;
+
+    if ((task->vars = Shell_Snapshot()) == NULL) {
+        free(task);
+        return -ENOMEM;
+    }
+
+    if ((id = Task_Spawn(VM_Task, task)) < 0) {
+        Shell_SnapshotFree(task->vars);
+        free(task);
+        return id;
+    }
+    program->refs++;
+    Shell_VarSetInt(bang, id);
+
+    return 0;
+}
+
+static int VM_Iteration(void *arg, uint32_t i)
+{
+    VM_Loop_t *loop = arg;
+
+    Shell_VarSet(loop->forpipeline->slot,
+            loop->program->words[loop->forpipeline->words + i]->str);
+
+    return VM_RunFrom(loop->program, loop->pc);
+}
+
+int VM_Run(AST_Program_t *program)
+{
+    return VM_RunFrom(program, 0);
+}
+
+static int VM_RunFrom(AST_Program_t *program, uint32_t pc)
+{
+    const VM_Op_t *code   = program->code;
+    int            status = 0;
+    uint32_t       loops[program->nloops + 1];
+    char          *argv[program->maxargc + 1];  /* Shared by every command */
+
+    for (;;) {
+        const VM_Op_t *op = &code[pc++];
+
+        switch (op->op) {
+            case OP_HALT:
+                return status;
+
+            case OP_STATUS:
+                status = op->a;
+                Shell_VarSetInt(program->status, status);
+                break;
+
+            case OP_ASSIGN:
+                status = AST_ProcessAssignment(program, &(AST_NODE(program, op->a)->assignment));
+                break;
+
+            case OP_COMMAND:
+                status = AST_ProcessCommand(program, &(AST_NODE(program, op->a)->command), argv);
+                break;
+
+            case OP_JUMP:
+                /* A loop going round lets anything in the background have
+                 * a turn */
+                if (op->a < pc) {
+                    Task_Yield();
+                }
+                pc = op->a;
+                break;
+
+            case OP_JUMP_TRUE:
+                if (status == 0) {
+                    pc = op->a;
+                }
+                break;
+
+            case OP_JUMP_FALSE:
+                if (status != 0) {
+                    pc = op->a;
+                }
+                break;
+
+            case OP_FOR_BEGIN:
+                /* A loop over no words succeeds */
+                loops[op->c] = 0;
+                status = 0;
+                Shell_VarSetInt(program->status, status);
+                break;
+
+            case OP_FOR_NEXT:
+            {
+                AST_ForPipeline_t *forpipeline = &(AST_NODE(program, op->a)->forpipeline);
+
+                if (loops[op->c] < forpipeline->nwords) {
+                    Shell_VarSet(forpipeline->slot,
+                            program->words[forpipeline->words + loops[op->c]++]->str);
+                } else {
+                    pc = op->b;
+                }
+                break;
+            }
+
+            case OP_FOR_PARALLEL:
+            {
+                VM_Loop_t loop = { program, &(AST_NODE(program, op->a)->forpipeline), pc };
+
+                status = Shell_ForEach(loop.forpipeline->nwords, loop.forpipeline->workers,
+                        VM_Iteration, &loop);
+                Shell_VarSetInt(program->status, status);
+                pc = op->b;
+                break;
+            }
+
+            case OP_PIPE:
+                status = AST_ProcessPipe(program, &(AST_NODE(program, op->a)->pipe));
+                break;
+
+            case OP_SPAWN:
+                /* Nothing can start while the fds are redirected, it runs
+                 * to its end here and now instead */
+                if (VM_Spawn(program, pc, op->b) < 0) {
+                    status = VM_RunFrom(program, pc);
+                } else {
+                    status = 0;
+                }
+                pc = op->a;
+                break;
+
+            case OP_TEST:
+                status = Test_Eval(program, op->a);
+                Shell_VarSetInt(program->status, status);
+                break;
+
+            default:
+                fprintf(stderr, "%s: Bad op %d at %u\n", __func__, op->op, pc - 1);
+                return -EINVAL;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
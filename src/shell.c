@@ -7,6 +7,7 @@
 //
 
 #define USE_DTRACE 0
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,7 +16,15 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <spawn.h>
 
 #include <libraries/parser.h>
 
@@ -30,278 +39,2220 @@
  *                              T Y P E S
  ****************************************************************************/
 typedef struct {
-    char *name;
-    char *value;
-} Env_t;
+    char     *name;
+    char     *value;            /* Reused by each assignment that fits */
+    size_t    size;
+    uint32_t  hash;
+    uint8_t   flags;
+    long      num;
+} Var_t;
 
-#define MAX_ENVS 16
+#define VAR_SET     0x01        /* Has a value */
+#define VAR_FORMAT  0x02        /* value is out of date, num holds it */
+#define VAR_NUM     0x04        /* num is value as an integer */
+#define VAR_NAN     0x08        /* value is not one, num is what strtol made of it */
+
+#define VAR_VALUE_MIN 16
+
+/* Variables live in a dense array so a slot never moves, the open addressed
+ * table maps a name to its slot and is rebuilt from the saved hashes when it
+ * passes half full */
+typedef struct {
+    Var_t    *vars;
+    uint32_t  nvars;
+    uint32_t  maxvars;
+    uint32_t *table;            /* Slot + 1, or 0 when empty */
+    uint32_t  tablesize;        /* Power of two */
+} Var_Store_t;
+
+#define VAR_TABLE_MIN 64
+
+/* What an iteration of a parallel for has assigned, laid over the variables
+ * of whoever started the loop, which it only ever reads. Only vars and nvars
+ * of the store are used, indexed by slot. A background loop has a snapshot,
+ * a copy of every variable as it started, so nothing shows through */
+typedef struct Var_Scope {
+    Var_Store_t        store;
+    struct Var_Scope  *parent;  /* NULL over the shell's own */
+    bool               snapshot;
+} Var_Scope_t;
+
+/* Everything one interpreter has to itself. Whichever a thread is running
+ * is its shell_context */
+struct Shell_Context {
+    Var_Store_t    vars;
+    Sink_t         out;
+    Source_t       in;
+    Job_Table_t   *jobs;
+    Path_Cache_t  *paths;
+    int            path;        /* Slot of PATH, the command cache goes when it is set */
+    int            bang;        /* Slot of $!, the last job started */
+};
+
+/* What a thread was running before it took up a shell */
+typedef struct {
+    Shell_Context_t *context;
+    Sink_t          *sink;
+    Var_Scope_t     *scope;
+} Shell_Saved_t;
+
+/* A stage of a pipeline run on a thread */
+typedef struct {
+    Shell_Context_t *context;   /* What the thread that started it had */
+    Var_Scope_t     *scope;
+    Shell_Stage_t   *stage;
+    Source_t         in;
+    Sink_t           out;
+    int              status;
+    pthread_t        thread;
+} Shell_Worker_t;
+
+typedef struct {
+    const char     *name;
+    Builtin_Func_t  func;
+} Builtin_t;
+
+/* Open addressed, kept at most half full so probes stay short */
+#define BUILTIN_SLOTS 32
+
+/* An iteration of a parallel for, its output is held until all those before
+ * it have gone */
+typedef struct {
+    Sink_t  out;
+    int     status;
+    bool    done;
+} Shell_Iteration_t;
+
+typedef struct {
+    Shell_Iteration_t  *iterations;
+    uint32_t            n;
+    uint32_t            emitted;    /* Next one to be written out */
+    pthread_mutex_t     lock;
+    Shell_Context_t    *context;    /* The shell running the loop */
+    Sink_t             *out;        /* Where the loop itself writes */
+    Var_Scope_t        *scope;      /* And the variables it sees */
+    int               (*func)(void *arg, uint32_t i);
+    void               *arg;
+} Shell_ForEach_t;
+
+/* A script run by shell -j, in a shell of its own. Its output is held until
+ * those before it have gone */
+typedef struct {
+    const char      *file;
+    Shell_Context_t *shell;
+    int              status;
+    bool             done;
+} Shell_Script_t;
+
+typedef struct {
+    Shell_Script_t  *scripts;
+    uint32_t         n;
+    uint32_t         emitted;       /* Next one to be written out */
+    pthread_mutex_t  lock;
+    Sink_t           out;
+} Shell_Batch_t;
+
+/* A builtin left running as a task, with its own copy of argv */
+typedef struct {
+    Builtin_Func_t  builtin;
+    int             argc;
+    char           *argv[];
+} Shell_Task_t;
+
+/* The most cat asks the kernel to move in one call */
+#define CAT_CHUNK     (1 << 30)
 
 /*****************************************************************************
  *                 F U N C T I O N     P R O T O T Y P E S
  ****************************************************************************/
 
-/*****************************************************************************
- *                     G L O B A L     V A R I A B L E S
- ****************************************************************************/
-Env_t env[MAX_ENVS];
+int Command_Test(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_Echo(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_Seq(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_True(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_False(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_Sleep(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_Cat(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_Hash(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+int Command_Wait(Sink_t *out, Source_t *in, int argc, char *const argv[]);
+Builtin_Func_t Shell_BuiltinLookup(const char *name);
+void Shell_SnapshotFree(void *snapshot);
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+static pthread_once_t shell_once = PTHREAD_ONCE_INIT;
+
+/* The shell this thread is running, where the commands it runs write and the
+ * variables they see. The last two are the shell's own unless it is running
+ * an iteration of a parallel for */
+static __thread Shell_Context_t *shell_context;
+static __thread Sink_t          *shell_sink;
+static __thread Var_Scope_t     *shell_scope;
+
+static const Builtin_t builtins[] = {
+    {"[",     Command_Test},
+    {"echo",  Command_Echo},
+    {"seq",   Command_Seq},
+    {"true",  Command_True},
+    {"false", Command_False},
+    {"sleep", Command_Sleep},
+    {"cat",   Command_Cat},
+    {"hash",  Command_Hash},
+    {"wait",  Command_Wait},
+};
+
+static const Builtin_t *builtin_table[BUILTIN_SLOTS];
+
+/****************************************************************************/
+/* FNV-1a */
+uint32_t Shell_Hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+
+    return h;
+}
+
+/* Returns the slot of name, or -1 */
+static int Var_Find(Var_Store_t *store, const char *name, uint32_t hash)
+{
+    uint32_t mask = store->tablesize - 1;
+    uint32_t i;
+    uint32_t slot;
+
+    if (store->table == NULL) {
+        return -1;
+    }
+
+    for (i = hash & mask; (slot = store->table[i]); i = (i + 1) & mask) {
+        Var_t *var = &store->vars[slot - 1];
+
+        if (var->hash == hash && strcmp(var->name, name) == 0) {
+            return slot - 1;
+        }
+    }
+
+    return -1;
+}
+
+static void Var_TableInsert(uint32_t *table, uint32_t size, uint32_t hash, uint32_t slot)
+{
+    uint32_t i;
+
+    for (i = hash & (size - 1); table[i]; i = (i + 1) & (size - 1))
+        ;
+    table[i] = slot + 1;
+}
+
+static int Var_TableGrow(Var_Store_t *store)
+{
+    uint32_t  size = store->tablesize ? 2*store->tablesize : VAR_TABLE_MIN;
+    uint32_t *table;
+    uint32_t  slot;
+
+    if ((table = calloc(size, sizeof(*table))) == NULL) {
+        return -ENOMEM;
+    }
+
+    for (slot = 0; slot < store->nvars; slot++) {
+        Var_TableInsert(table, size, store->vars[slot].hash, slot);
+    }
+
+    free(store->table);
+    store->table     = table;
+    store->tablesize = size;
+
+    return 0;
+}
+
+/* Returns the slot of name, adding it unset if it is new, or -ENOMEM */
+int Var_Slot(Var_Store_t *store, const char *name)
+{
+    uint32_t hash = Shell_Hash(name);
+    Var_t   *var;
+    int      slot;
+
+    if ((slot = Var_Find(store, name, hash)) >= 0) {
+        return slot;
+    }
+
+    if (2*(store->nvars + 1) > store->tablesize) {
+        if (Var_TableGrow(store) < 0) {
+            return -ENOMEM;
+        }
+    }
+
+    if (store->nvars == store->maxvars) {
+        uint32_t n = store->maxvars ? 2*store->maxvars : VAR_TABLE_MIN/2;
+
+        if ((var = realloc(store->vars, n*sizeof(*var))) == NULL) {
+            return -ENOMEM;
+        }
+        store->vars    = var;
+        store->maxvars = n;
+    }
+
+    var = &store->vars[store->nvars];
+    if ((var->name = strdup(name)) == NULL) {
+        return -ENOMEM;
+    }
+    var->value = NULL;
+    var->size  = 0;
+    var->hash  = hash;
+    var->flags = 0;
+
+    Var_TableInsert(store->table, store->tablesize, hash, store->nvars);
+
+    return store->nvars++;
+}
+
+/* Make sure the value buffer holds at least size bytes */
+static int Var_Reserve(Var_t *var, size_t size)
+{
+    char *v;
+
+    if (size <= var->size) {
+        return 0;
+    }
+
+    if (size < 2*var->size) {
+        size = 2*var->size;
+    }
+    if (size < VAR_VALUE_MIN) {
+        size = VAR_VALUE_MIN;
+    }
+
+    /* The old value is always overwritten, no need to keep it */
+    if ((v = malloc(size)) == NULL) {
+        return -ENOMEM;
+    }
+    free(var->value);
+    var->value = v;
+    var->size  = size;
+
+    return 0;
+}
+
+int Var_Set(Var_Store_t *store, int slot, const char *value)
+{
+    Var_t  *var = &store->vars[slot];
+    size_t  len = strlen(value);
+
+    if (Var_Reserve(var, len + 1) < 0) {
+        return -ENOMEM;
+    }
+    memmove(var->value, value, len + 1);
+    var->flags = VAR_SET;
+
+    return 0;
+}
+
+/* Numbers are only turned into text if something reads them */
+int Var_SetInt(Var_Store_t *store, int slot, long num)
+{
+    Var_t *var = &store->vars[slot];
+
+    var->num   = num;
+    var->flags = VAR_SET | VAR_FORMAT | VAR_NUM;
+
+    return 0;
+}
+
+/* The value as an integer, worked out once per assignment */
+long Var_GetInt(Var_Store_t *store, int slot)
+{
+    Var_t *var = &store->vars[slot];
+
+    if (!(var->flags & VAR_SET)) {
+        return 0;
+    }
+
+    if (!(var->flags & VAR_NUM)) {
+        char *end;
+
+        var->num    = strtol(var->value, &end, 0);
+        var->flags |= VAR_NUM;
+        if (end == var->value || *end != '\0') {
+            var->flags |= VAR_NAN;
+        }
+    }
+
+    return var->num;
+}
+
+char *Var_Get(Var_Store_t *store, int slot)
+{
+    Var_t *var = &store->vars[slot];
+
+    if (!(var->flags & VAR_SET)) {
+        return NULL;
+    }
+
+    if (var->flags & VAR_FORMAT) {
+        if (Var_Reserve(var, 3*sizeof(long) + 2) < 0) {
+            return NULL;
+        }
+        snprintf(var->value, var->size, "%ld", var->num);
+        var->flags &= ~VAR_FORMAT;
+    }
+
+    return var->value;
+}
+
+void Var_Free(Var_Store_t *store)
+{
+    uint32_t i;
+
+    for (i = 0; i < store->nvars; i++) {
+        free(store->vars[i].name);
+        free(store->vars[i].value);
+    }
+    free(store->vars);
+    free(store->table);
+    memset(store, 0, sizeof(*store));
+}
+
+/* Work out every value that is only worked out when read, so reading is
+ * safe from any number of threads */
+static void Var_Settle(Var_Store_t *store)
+{
+    uint32_t i;
+
+    for (i = 0; i < store->nvars; i++) {
+        Var_Get(store, i);
+        Var_GetInt(store, i);
+    }
+}
+
+/* The innermost store that has slot set */
+static Var_Store_t *Shell_VarStore(int slot)
+{
+    Var_Scope_t *scope;
+
+    for (scope = shell_scope; scope; scope = scope->parent) {
+        if ((uint32_t) slot < scope->store.nvars &&
+                (scope->snapshot || (scope->store.vars[slot].flags & VAR_SET))) {
+            return &scope->store;
+        }
+    }
+
+    return &shell_context->vars;
+}
+
+/* Where an assignment to slot goes. Returns NULL for a slot made after the
+ * scope was, which only the shell's own store can have */
+static Var_Store_t *Shell_VarScope(int slot, bool *flush)
+{
+    *flush = false;
+
+    if (shell_scope == NULL) {
+        *flush = (slot == shell_context->path);
+        return &shell_context->vars;
+    }
+
+    /* The command cache is the shell's, an iteration leaves it be */
+    return ((uint32_t) slot < shell_scope->store.nvars) ? &shell_scope->store : NULL;
+}
+
+/* The shell's own variables by slot, for the compiler and the VM */
+int Shell_VarSlot(const char *name)
+{
+    return Var_Slot(&shell_context->vars, name);
+}
+
+char *Shell_VarGet(int slot)
+{
+    return Var_Get(Shell_VarStore(slot), slot);
+}
+
+int Shell_VarSet(int slot, const char *value)
+{
+    Var_Store_t *store;
+    bool         flush;
+
+    if ((store = Shell_VarScope(slot, &flush)) == NULL) {
+        return -EINVAL;
+    }
+    if (flush) {
+        Path_Flush(shell_context->paths);
+    }
+
+    return Var_Set(store, slot, value);
+}
+
+int Shell_VarSetInt(int slot, long num)
+{
+    Var_Store_t *store;
+    bool         flush;
+
+    if ((store = Shell_VarScope(slot, &flush)) == NULL) {
+        return -EINVAL;
+    }
+    if (flush) {
+        Path_Flush(shell_context->paths);
+    }
+
+    return Var_SetInt(store, slot, num);
+}
+
+long Shell_VarGetInt(int slot)
+{
+    return Var_GetInt(Shell_VarStore(slot), slot);
+}
+
+/* For [ ], where a variable compared as a number has to be one. Returns
+ * -EINVAL when it is unset or is not */
+int Shell_VarGetNum(int slot, long *num)
+{
+    Var_Store_t *store = Shell_VarStore(slot);
+
+    *num = Var_GetInt(store, slot);
+
+    return ((store->vars[slot].flags & (VAR_SET | VAR_NAN)) == VAR_SET) ? 0 : -EINVAL;
+}
+
+/* Whether this thread is running an iteration of a parallel for */
+static bool Shell_Parallel(void)
+{
+    return shell_scope && !shell_scope->snapshot;
+}
+
+/* A copy of the variables as they are now, for a background loop to work on
+ * as a subshell would. NULL without the memory */
+void *Shell_Snapshot(void)
+{
+    Var_Scope_t *scope;
+    uint32_t     nvars = shell_context->vars.nvars;
+    const char  *value;
+    uint32_t     slot;
+
+    if ((scope = calloc(1, sizeof(*scope))) == NULL) {
+        return NULL;
+    }
+    if ((scope->store.vars = calloc(nvars ? nvars : 1, sizeof(Var_t))) == NULL) {
+        free(scope);
+        return NULL;
+    }
+    scope->store.nvars = nvars;
+    scope->snapshot    = true;
+
+    for (slot = 0; slot < nvars; slot++) {
+        if ((value = Shell_VarGet(slot)) && Var_Set(&scope->store, slot, value) < 0) {
+            Shell_SnapshotFree(scope);
+            return NULL;
+        }
+    }
+
+    return scope;
+}
+
+void Shell_SnapshotFree(void *snapshot)
+{
+    Var_Scope_t *scope = snapshot;
+
+    Var_Free(&scope->store);
+    free(scope);
+}
+
+/* Run func over the variables in snapshot, which it then frees. The task it
+ * runs in keeps them as it is switched in and out, see Shell_TaskSwap */
+int Shell_SnapshotRun(void *snapshot, int (*func)(void *arg), void *arg)
+{
+    Var_Scope_t *outer = shell_scope;
+    int          r;
+
+    shell_scope = snapshot;
+    r = func(arg);
+    shell_scope = outer;
+
+    Shell_SnapshotFree(snapshot);
+
+    return r;
+}
+
+static void *Shell_TaskSwap(void *local)
+{
+    Var_Scope_t *scope = shell_scope;
+
+    shell_scope = local;
+
+    return scope;
+}
+
+/* Whether output is being collected rather than written out, as it is for an
+ * iteration of a parallel for or a shell run for someone else. The fds are
+ * shared with whatever is running alongside, so they are left alone */
+bool Shell_Collecting(void)
+{
+    return (shell_sink->fd < 0) && (shell_sink->ring == NULL);
+}
+
+int my_setenv(char *name, char *value, int overwrite)
+{
+    int slot;
+
+    if ((slot = Var_Slot(&shell_context->vars, name)) < 0) {
+        return slot;
+    }
+
+    /* We found it, but don't wont to overwrite */
+    if (Var_Get(&shell_context->vars, slot) && !overwrite) {
+        return 0;
+    }
+
+    return Shell_VarSet(slot, value);
+}
+
+char *my_getenv(char *name)
+{
+    int slot;
+
+    if ((slot = Var_Find(&shell_context->vars, name, Shell_Hash(name))) < 0) {
+        DTRACE("Unable to find %s\n", name);
+        return NULL;
+    }
+
+    return Var_Get(&shell_context->vars, slot);
+}
+
+int Command_Test(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    if (argc > 3 && (strcmp(argv[1], "-n") == 0)) {
+        /* Check for empty string */
+        return (argv[2][0] != 0) ? 0 : 1;
+    } else if (argc > 3 && (strcmp(argv[1], "-z") == 0)) {
+        return (argv[2][0] == 0) ? 0 : 1;
+    } else if (argc >= 4 && (strcmp(argv[2], "=") == 0)) {
+        return (strcmp(argv[1], argv[3]) == 0) ? 0 : 1;
+    } else if (argc >= 4 && (strcmp(argv[2], "!=") == 0)) {
+        return (strcmp(argv[1], argv[3]) != 0) ? 0 : 1;
+    } else if (argc >= 4 && argv[2][0] == '-') {
+        long x = strtol(argv[1], NULL, 0);
+        long y = strtol(argv[3], NULL, 0);
+
+        if (strcmp(argv[2], "-lt") == 0) {
+            return (x <  y) ? 0 : 1;
+        } else if (strcmp(argv[2], "-le") == 0) {
+            return (x <= y) ? 0 : 1;
+        } else if (strcmp(argv[2], "-gt") == 0) {
+            return (x >  y) ? 0 : 1;
+        } else if (strcmp(argv[2], "-ge") == 0) {
+            return (x >= y) ? 0 : 1;
+        } else if (strcmp(argv[2], "-eq") == 0) {
+            return (x == y) ? 0 : 1;
+        } else if (strcmp(argv[2], "-ne") == 0) {
+            return (x != y) ? 0 : 1;
+        }
+    } else if (argc == 3) {
+        /* Check for empty string */
+        return (argv[1][0] != 0) ? 0 : 1;
+    }
+
+    return 1;
+}
+
+int Command_Echo(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        Sink_Puts(out, argv[i]);
+        Sink_Write(out, (i + 1 < argc) ? " " : "\n", 1);
+    }
+    if (argc < 2) {
+        Sink_Write(out, "\n", 1);
+    }
+
+    return 0;
+}
+
+/* Writes n right aligned to end, two digits at a time, zero padded to width.
+ * Returns where the number starts */
+static char *Command_Itoa(char *end, int64_t n, int width)
+{
+    static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    uint64_t u     = (n < 0) ? -(uint64_t) n : (uint64_t) n;
+    char    *start = end;
+
+    while (u >= 100) {
+        unsigned int i = (u % 100) * 2;
+
+        u /= 100;
+        *--start = digits[i + 1];
+        *--start = digits[i];
+    }
+    if (u >= 10) {
+        *--start = digits[u*2 + 1];
+        *--start = digits[u*2];
+    } else {
+        *--start = '0' + u;
+    }
+
+    while (end - start < width - (n < 0)) {
+        *--start = '0';
+    }
+    if (n < 0) {
+        *--start = '-';
+    }
+
+    return start;
+}
+
+static bool Command_Int(const char *s, int64_t *n)
+{
+    char *end;
+
+    errno = 0;
+    *n = strtoll(s, &end, 0);
+
+    return (*s != '\0') && (*end == '\0') && (errno == 0);
+}
+
+/* seq [-w] [FIRST [INCR]] LAST */
+int Command_Seq(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    int64_t  first = 1;
+    int64_t  incr  = 1;
+    int64_t  last;
+    int64_t  n;
+    uint64_t count;
+    int      width = 0;
+    char     num[24];
+    char    *start;
+    int      len;
+    int      i = 1;
+
+    if (i < argc && strcmp(argv[i], "-w") == 0) {
+        width = 1;
+        i++;
+    }
+
+    if ((argc - i < 1) || (argc - i > 3) ||
+            !Command_Int(argv[argc - 1], &last) ||
+            ((argc - i >= 2) && !Command_Int(argv[i], &first)) ||
+            ((argc - i == 3) && !Command_Int(argv[i + 1], &incr))) {
+        fprintf(stderr, "seq: usage: seq [-w] [FIRST [INCR]] LAST\n");
+        return 1;
+    }
+    if (incr == 0) {
+        fprintf(stderr, "seq: increment must not be zero\n");
+        return 1;
+    }
+
+    if ((incr > 0) ? (first > last) : (first < last)) {
+        return 0;
+    }
+    count = ((incr > 0) ? (uint64_t) last - first : (uint64_t) first - last) /
+            ((incr > 0) ? (uint64_t) incr : -(uint64_t) incr);
+
+    /* -w pads to the wider of the two ends */
+    if (width) {
+        int a = &num[sizeof(num)] - Command_Itoa(&num[sizeof(num)], first, 0);
+        int b = &num[sizeof(num)] - Command_Itoa(&num[sizeof(num)], last, 0);
+
+        width = (a > b) ? a : b;
+    }
+
+    /* Counting up by one from zero or more, keep the number as text and
+     * add to its last digit rather than converting each one */
+    if (incr == 1 && first >= 0) {
+        start = Command_Itoa(&num[sizeof(num) - 1], first, width);
+        num[sizeof(num) - 1] = '\n';
+        len = &num[sizeof(num)] - start;
+
+        for (;;) {
+            char *d;
+
+            if (out->size - out->len < sizeof(num) && Sink_Reserve(out, sizeof(num)) < 0) {
+                return 1;
+            }
+            memcpy(&out->buf[out->len], start, len);
+            out->len += len;
+
+            if (count-- == 0) {
+                break;
+            }
+
+            for (d = &num[sizeof(num) - 2]; d >= start && *d == '9'; d--) {
+                *d = '0';
+            }
+            if (d < start) {
+                *--start = '1';
+                len++;
+            } else {
+                (*d)++;
+            }
+        }
+
+        return 0;
+    }
+
+    for (n = first; ; n += incr) {
+        if (out->size - out->len < sizeof(num) && Sink_Reserve(out, sizeof(num)) < 0) {
+            return 1;
+        }
+        start = Command_Itoa(&num[sizeof(num) - 1], n, width);
+        num[sizeof(num) - 1] = '\n';
+        len = &num[sizeof(num)] - start;
+        memcpy(&out->buf[out->len], start, len);
+        out->len += len;
+
+        if (count-- == 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int Command_True(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    return 0;
+}
+
+int Command_False(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    return 1;
+}
+
+/* sleep n[smhd] ..., the times are added up and may have fractions */
+int Command_Sleep(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    double secs = 0;
+    double n;
+    char  *end;
+    int    i;
+
+    if (argc < 2) {
+        Sink_Flush(out);
+        fprintf(stderr, "sleep: missing operand\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        n = strtod(argv[i], &end);
+        switch (*end) {
+            case 'd': n *= 24;  /* Fall through */
+            case 'h': n *= 60;  /* Fall through */
+            case 'm': n *= 60;  /* Fall through */
+            case 's': end++;    break;
+        }
+
+        if (end == argv[i] || *end != '\0' || !(n >= 0)) {
+            Sink_Flush(out);
+            fprintf(stderr, "sleep: invalid time interval '%s'\n", argv[i]);
+            return 1;
+        }
+        secs += n;
+    }
+
+    /* Nothing is going to be written for a while */
+    Sink_Flush(out);
+    Task_Block(-1, (secs < INT64_MAX / 1e9) ? (int64_t) (secs * 1e9) : INT64_MAX);
+
+    return 0;
+}
+
+/* Copy in to where out goes. The kernel moves the data itself when it can,
+ * copy_file_range between files, sendfile from a file and splice from a pipe.
+ * Whatever is left is read straight into the sink */
+static int Command_CatFd(Sink_t *out, Source_t *in)
+{
+    ssize_t n;
+
+    if (out->fd >= 0 && in->ring == NULL) {
+        if (Sink_Flush(out) < 0) {
+            return -EIO;
+        }
+
+        /* Each one carries on from where the last got to */
+        while ((n = copy_file_range(in->fd, NULL, out->fd, NULL, CAT_CHUNK, 0)) > 0)
+            ;
+        if (n == 0) {
+            return 0;
+        }
+        while ((n = sendfile(out->fd, in->fd, NULL, CAT_CHUNK)) > 0)
+            ;
+        if (n == 0) {
+            return 0;
+        }
+        while ((n = splice(in->fd, NULL, out->fd, NULL, CAT_CHUNK, SPLICE_F_MOVE)) > 0)
+            ;
+        if (n == 0) {
+            return 0;
+        }
+    }
+
+    for (;;) {
+        if ((n = Sink_Reserve(out, SINK_SIZE_MIN)) < 0) {
+            return n;
+        }
+        if ((n = Source_Read(in, &out->buf[out->len], out->size - out->len)) <= 0) {
+            return n;
+        }
+        out->len += n;
+    }
+}
+
+int Command_Cat(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    Source_t file = { -1, NULL };
+    int      r    = 0;
+    int      e;
+    int      i;
+
+    if (argc == 1) {
+        return (Command_CatFd(out, in) < 0) ? 1 : 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            e = Command_CatFd(out, in);
+        } else if ((file.fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            e = -errno;
+        } else {
+            e = Command_CatFd(out, &file);
+            close(file.fd);
+        }
+
+        if (e == -EPIPE) {
+            return 1;
+        } else if (e < 0) {
+            Sink_Flush(out);
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(-e));
+            r = 1;
+        }
+    }
+
+    return r;
+}
+
+/* hash [-r] [name ...] */
+int Command_Hash(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    int r = 0;
+    int i = 1;
+
+    if (i < argc && strcmp(argv[i], "-r") == 0) {
+        /* Other iterations of a parallel for may be using it */
+        if (!Shell_Parallel()) {
+            Path_Flush(shell_context->paths);
+        }
+        i++;
+    } else if (argc == 1) {
+        return Path_Print(shell_context->paths, out);
+    }
+
+    for (; i < argc; i++) {
+        if (!Shell_BuiltinLookup(argv[i]) && !Path_Lookup(shell_context->paths, argv[i])) {
+            Sink_Flush(out);
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            r = 1;
+        }
+    }
+
+    return r;
+}
+
+/* wait [pid ...], the status is that of the last pid. Builtins left running
+ * in the shell have a task id in place of a pid */
+int Command_Wait(Sink_t *out, Source_t *in, int argc, char *const argv[])
+{
+    char *end;
+    long  pid;
+    int   r = 0;
+    int   i;
+
+    Sink_Flush(out);
+
+    /* An iteration of a parallel for can not start anything to wait for */
+    if (Shell_Parallel()) {
+        return 0;
+    }
+
+    if (argc == 1) {
+        Task_JoinAll();
+        Job_WaitAll(shell_context->jobs);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        pid = strtol(argv[i], &end, 10);
+        if (*argv[i] == '\0' || *end != '\0' || pid <= 0) {
+            fprintf(stderr, "wait: %s: not a pid\n", argv[i]);
+            r = 2;
+        } else if ((r = (pid > TASK_ID_BASE) ? Task_Join(pid) :
+                    Job_Wait(shell_context->jobs, pid)) < 0) {
+            fprintf(stderr, "wait: pid %ld is not a child of this shell\n", pid);
+            r = 127;
+        }
+    }
+
+    return r;
+}
+
+static void Shell_BuiltinInit(void)
+{
+    size_t i;
+    uint32_t slot;
+
+    for (i = 0; i < sizeof(builtins)/sizeof(builtins[0]); i++) {
+        slot = Shell_Hash(builtins[i].name);
+        while (builtin_table[slot & (BUILTIN_SLOTS - 1)]) {
+            slot++;
+        }
+        builtin_table[slot & (BUILTIN_SLOTS - 1)] = &builtins[i];
+    }
+}
+
+/* Returns the handler for a builtin, or NULL when name is not one */
+Builtin_Func_t Shell_BuiltinLookup(const char *name)
+{
+    const Builtin_t *b;
+    uint32_t slot;
+
+    for (slot = Shell_Hash(name); (b = builtin_table[slot & (BUILTIN_SLOTS - 1)]); slot++) {
+        if (strcmp(b->name, name) == 0) {
+            return b->func;
+        }
+    }
+
+    return NULL;
+}
+
+/* Where name runs from. The cache goes by the shell's own PATH, an iteration
+ * of a parallel for or a background loop that has one of its own searches
+ * it every time */
+static const char *Shell_PathLookup(const char *name, char *buf, size_t size)
+{
+    Var_Store_t *store;
+    const char  *dirs;
+    const char  *own;
+
+    if (shell_scope &&
+            (store = Shell_VarStore(shell_context->path)) != &shell_context->vars &&
+            (dirs = Var_Get(store, shell_context->path)) &&
+            (!(own = Var_Get(&shell_context->vars, shell_context->path)) || strcmp(dirs, own) != 0)) {
+        return Path_Resolve(dirs, name, buf, size);
+    }
+
+    return Path_Lookup(shell_context->paths, name);
+}
+
+/* Start argv[0] from where PATH says it is. Returns its pid, or a negative
+ * errno having said why not */
+pid_t Shell_Spawn(char *const argv[], const posix_spawn_file_actions_t *actions)
+{
+    const char *path;
+    char        buf[PATH_MAX];
+    pid_t       pid;
+    int         r;
+
+    if ((path = Shell_PathLookup(argv[0], buf, sizeof(buf))) == NULL) {
+        fprintf(stderr, "%s: not found\n", argv[0]);
+        return -ENOENT;
+    }
+
+    if ((r = posix_spawn(&pid, path, actions, NULL, argv, environ)) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(r));
+        return -r;
+    }
+
+    return pid;
+}
+
+/* The status for a command that could not be started */
+static int Shell_SpawnStatus(pid_t error)
+{
+    return (error == -ENOENT) ? 127 : 126;
+}
+
+/* Wait for pid and return its status the way $? has it */
+int Shell_Wait(pid_t pid)
+{
+    int status;
+    int pidfd;
+
+    /* Tasks carry on until it exits */
+    if (Task_Pending() && (pidfd = Job_Pidfd(pid)) >= 0) {
+        Task_Block(pidfd, -1);
+        close(pidfd);
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return 1;
+        }
+    }
+
+    return Job_Status(status);
+}
+
+/* Leave pid running as a job and point $! at it. out is the read end of
+ * its stdout when the shell collects what it writes, otherwise -1 */
+static int Shell_Background(pid_t pid, int out)
+{
+    if (Job_Add(shell_context->jobs, pid, out) < 0) {
+        fprintf(stderr, "%d: %s\n", pid, strerror(ENOMEM));
+        if (out >= 0) {
+            Source_t from = { out, NULL };
+
+            Command_CatFd(shell_sink, &from);
+            close(out);
+        }
+        return Shell_Wait(pid);
+    }
+    Shell_VarSetInt(shell_context->bang, pid);
+
+    /* Any that have already finished are collected rather than left as
+     * zombies until the next wait */
+    Job_Poll(shell_context->jobs, 0);
+
+    return 0;
+}
+
+static int Shell_TaskRun(void *arg)
+{
+    Shell_Task_t *task = arg;
+    int r;
+
+    r = task->builtin(shell_sink, &shell_context->in, task->argc, task->argv);
+    if (shell_sink->tty) {
+        Sink_Flush(shell_sink);
+    }
+    free(task);
+
+    return r;
+}
+
+/* Leave builtin running in the shell alongside what comes next, and point $!
+ * at it. Returns the task id, or a negative errno */
+static int Shell_Task(Builtin_Func_t builtin, int argc, char *const argv[])
+{
+    Shell_Task_t *task;
+    size_t size = sizeof(*task) + (argc + 1) * sizeof(char *);
+    char  *p;
+    int    id;
+    int    i;
+
+    /* The program's argv is reused by the next command */
+    for (i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+    if ((task = malloc(size)) == NULL) {
+        return -ENOMEM;
+    }
+    task->builtin = builtin;
+    task->argc    = argc;
+
+    p = (char *) &task->argv[argc + 1];
+    for (i = 0; i < argc; i++) {
+        task->argv[i] = strcpy(p, argv[i]);
+        p += strlen(p) + 1;
+    }
+    task->argv[argc] = NULL;
+
+    if ((id = Task_Spawn(Shell_TaskRun, task)) < 0) {
+        free(task);
+        return id;
+    }
+    Shell_VarSetInt(shell_context->bang, id);
+
+    return id;
+}
+
+/* Run builtin in a child of its own */
+static pid_t Shell_Fork(Builtin_Func_t builtin, int argc, char *const argv[])
+{
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        int r = builtin(shell_sink, &shell_context->in, argc, argv);
+
+        Sink_Flush(shell_sink);
+        _exit(r);
+    } else if (pid < 0) {
+        pid = -errno;
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    }
+
+    return pid;
+}
+
+int Shell_RunCommand(Builtin_Func_t builtin, int argc, char *const argv[], bool background)
+{
+    pid_t pid;
+    int   i;
+    int   r;
+
+    DTRACE("Running command ");
+    for (i = 0; i < argc; i++) {
+        DTRACE("'%s' ", argv[i]);
+    }
+    DTRACE("%s\n", background ? "in the background" : "");
+    DTRACE("\n");
+
+    /* A builtin shares the shell's fds, it stays in the shell unless it has
+     * redirections of its own */
+    if (background && builtin && Shell_Task(builtin, argc, argv) >= 0) {
+        return 0;
+    }
+
+    if (background) {
+        Sink_Flush(shell_sink);
+
+        pid = builtin ? Shell_Fork(builtin, argc, argv) : Shell_Spawn(argv, NULL);
+
+        return (pid < 0) ? Shell_SpawnStatus(pid) : Shell_Background(pid, -1);
+    }
+
+    if (builtin) {
+        r = builtin(shell_sink, &shell_context->in, argc, argv);
+    } else {
+        /* It writes to the fd itself */
+        Sink_Flush(shell_sink);
+
+        if ((pid = Shell_Spawn(argv, NULL)) < 0) {
+            r = Shell_SpawnStatus(pid);
+        } else {
+            r = Shell_Wait(pid);
+        }
+    }
+
+    /* Someone may be watching */
+    if (shell_sink->tty) {
+        Sink_Flush(shell_sink);
+    }
+
+    return r;
+}
+
+/* Point fd at target for one command. What fd had before is kept in saved,
+ * which is -1 when it was not open */
+int Shell_Redirect(Token_Type_t type, int fd, const char *target, int *saved)
+{
+    char *end;
+    int   newfd;
+    int   r;
+
+    /* Anything held for the old fd goes there first */
+    Sink_Flush(shell_sink);
+
+    switch (type) {
+        case TOKEN_LEFTARROW:
+            newfd = open(target, O_RDONLY | O_CLOEXEC);
+            break;
+        case TOKEN_RIGHTARROW:
+            newfd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            break;
+        case TOKEN_APPEND:
+            newfd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+            break;
+        case TOKEN_DUP:
+            newfd = strtol(target, &end, 10);
+            if (!isdigit((unsigned char) target[0]) || *end != '\0') {
+                fprintf(stderr, "%s: ambiguous redirect\n", target);
+                return -EINVAL;
+            }
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (newfd < 0) {
+        r = -errno;
+        fprintf(stderr, "%s: %s\n", target, strerror(errno));
+        return r;
+    }
+
+    /* Every task shares the fds, none may run until they are put back */
+    Task_Hold();
+
+    if (type != TOKEN_DUP && newfd == fd) {
+        /* open() handed back the fd that was closed */
+        *saved = -1;
+        return 0;
+    }
+
+    if ((*saved = fcntl(fd, F_DUPFD_CLOEXEC, 10)) < 0 && errno != EBADF) {
+        r = -errno;
+        Task_Release();
+        goto redirect_fail;
+    }
+
+    if (dup2(newfd, fd) < 0) {
+        r = -errno;
+        if (*saved >= 0) {
+            close(*saved);
+        }
+        Task_Release();
+        goto redirect_fail;
+    }
+
+    if (type != TOKEN_DUP) {
+        close(newfd);
+    }
+
+    return 0;
+
+redirect_fail:
+    fprintf(stderr, "%d: %s\n", fd, strerror(-r));
+    if (type != TOKEN_DUP) {
+        close(newfd);
+    }
+
+    return r;
+}
+
+/* Give fd back what it had before Shell_Redirect */
+void Shell_RedirectRestore(int fd, int saved)
+{
+    Sink_Flush(shell_sink);
+    Task_Release();
+
+    if (saved < 0) {
+        close(fd);
+        return;
+    }
+
+    dup2(saved, fd);
+    close(saved);
+}
+
+/* A stage can share the shell's fds with the others when its redirections
+ * only touch the one end of the pipeline it owns. While output is collected
+ * the fds are shared with more than the pipeline, and are not touched at all */
+static bool Shell_PipeInProcess(Shell_Stage_t *stages, int n)
+{
+    const AST_Redirect_t *redirect;
+    uint32_t i;
+    int      s;
+
+    for (s = 0; s < n; s++) {
+        if (stages[s].builtin == NULL ||
+                (stages[s].command->nredirects && Shell_Collecting())) {
+            return false;
+        }
+
+        for (i = 0; i < stages[s].command->nredirects; i++) {
+            redirect = &stages[s].program->redirects[stages[s].command->redirects + i];
+
+            if (!(s == 0 && redirect->fd == STDIN_FILENO) &&
+                    !(s == n - 1 && redirect->fd == STDOUT_FILENO)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void *Shell_PipeStage(void *arg)
+{
+    Shell_Worker_t *worker = arg;
+    Shell_Stage_t  *stage  = worker->stage;
+
+    /* The builtin sees the shell, and knows if it is in a parallel for, as
+     * it would running in the pipeline's own thread */
+    shell_context  = worker->context;
+    shell_scope    = worker->scope;
+    worker->status = stage->builtin(&worker->out, &worker->in, stage->argc, stage->argv);
+    Sink_Flush(&worker->out);
+
+    /* Let the stages either side finish */
+    Ring_CloseWrite(worker->out.ring);
+    if (worker->in.ring) {
+        Ring_CloseRead(worker->in.ring);
+    }
+
+    return NULL;
+}
+
+/* Every stage is a builtin, each runs on its own thread bar the last, which
+ * runs here and writes to the shell's own output */
+static int Shell_PipeThreads(Shell_Stage_t *stages, int n)
+{
+    Shell_Worker_t workers[n];
+    Source_t       in = shell_context->in;
+    int            first[stages[0].command->nredirects + 1];
+    int            last[stages[n - 1].command->nredirects + 1];
+    int            started;
+    int            r = 1;
+
+    if (AST_ApplyRedirects(stages[0].program, stages[0].command, first) < 0) {
+        return 1;
+    }
+    if (AST_ApplyRedirects(stages[n - 1].program, stages[n - 1].command, last) < 0) {
+        AST_RestoreRedirects(stages[0].program, stages[0].command, first,
+                stages[0].command->nredirects);
+        return 1;
+    }
+    Sink_Flush(shell_sink);
+
+    for (started = 0; started < n - 1; started++) {
+        Shell_Worker_t *worker = &workers[started];
+        Ring_t         *ring;
+
+        worker->context = shell_context;
+        worker->scope   = shell_scope;
+        worker->stage   = &stages[started];
+        worker->in      = in;
+        if ((ring = Ring_New()) == NULL) {
+            break;
+        }
+        if (Sink_InitRing(&worker->out, ring) < 0) {
+            Ring_Free(ring);
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, Shell_PipeStage, worker) != 0) {
+            Sink_Free(&worker->out);
+            Ring_Free(ring);
+            break;
+        }
+
+        in.fd   = -1;
+        in.ring = ring;
+    }
+
+    if (started == n - 1) {
+        r = stages[n - 1].builtin(shell_sink, &in, stages[n - 1].argc, stages[n - 1].argv);
+    } else {
+        fprintf(stderr, "%s: %s\n", stages[started].argv[0], strerror(ENOMEM));
+    }
+    if (in.ring) {
+        Ring_CloseRead(in.ring);
+    }
+
+    while (started-- > 0) {
+        pthread_join(workers[started].thread, NULL);
+        Sink_Free(&workers[started].out);
+        Ring_Free(workers[started].out.ring);
+    }
 
-/****************************************************************************/
-void env_cleanup(void)
+    AST_RestoreRedirects(stages[n - 1].program, stages[n - 1].command, last,
+            stages[n - 1].command->nredirects);
+    AST_RestoreRedirects(stages[0].program, stages[0].command, first,
+            stages[0].command->nredirects);
+
+    return r;
+}
+
+/* An external stage is spawned with its end of the pipes and its
+ * redirections set up in the child, leaving the shell's own fds alone */
+static pid_t Shell_SpawnStage(Shell_Stage_t *stage, int in, int out)
 {
-    size_t i;
-    for (i = 0; i < MAX_ENVS; i++) {
-        if (env[i].name) {
-            free(env[i].name);
-            free(env[i].value);
-            env[i].name  = NULL;
-            env[i].value = NULL;
+    posix_spawn_file_actions_t actions;
+    const AST_Redirect_t *redirect;
+    const char *target;
+    pid_t       pid;
+    uint32_t    i;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (out >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+
+    for (i = 0; i < stage->command->nredirects; i++) {
+        redirect = &stage->program->redirects[stage->command->redirects + i];
+
+        target = redirect->target->str;
+        if (redirect->slot >= 0 && (target = Shell_VarGet(redirect->slot)) == NULL) {
+            target = "";
+        }
+
+        switch (redirect->type) {
+            case TOKEN_LEFTARROW:
+                posix_spawn_file_actions_addopen(&actions, redirect->fd, target,
+                        O_RDONLY, 0);
+                break;
+            case TOKEN_RIGHTARROW:
+                posix_spawn_file_actions_addopen(&actions, redirect->fd, target,
+                        O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                break;
+            case TOKEN_APPEND:
+                posix_spawn_file_actions_addopen(&actions, redirect->fd, target,
+                        O_WRONLY | O_CREAT | O_APPEND, 0666);
+                break;
+            default:
+                posix_spawn_file_actions_adddup2(&actions, atoi(target), redirect->fd);
+                break;
         }
     }
+
+    pid = Shell_Spawn(stage->argv, &actions);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return pid;
 }
 
-int my_setenv(char *name, char *value, int overwrite)
+/* Anything else gets a process for each stage joined by kernel pipes. Only
+ * builtins need a fork, external commands are spawned */
+static int Shell_PipeProcesses(Shell_Stage_t *stages, int n)
 {
-    size_t i;
+    pid_t pids[n];
+    int   fds[2];
+    int   collect[2] = { -1, -1 };
+    int   in = -1;
+    int   r = 1;
+    int   s;
 
-    /* First search for the name and see if we need to replace it */
-    for (i = 0; i < MAX_ENVS; i++) {
-        if (env[i].name && strcmp(env[i].name, name) == 0) {
-            if (overwrite) {
-                char *v;
+    Sink_Flush(shell_sink);
 
-                if ((v = strdup(value)) == NULL) {
-                    return -ENOMEM;
-                }
+    /* Collected output takes in what the last stage writes */
+    if (Shell_Collecting() && pipe2(collect, O_CLOEXEC) < 0) {
+        fprintf(stderr, "%s: %s\n", stages[0].argv[0], strerror(errno));
+        return 1;
+    }
 
-                free(env[i].value);
-                env[i].value = v;
-                return 0;
-            } else {
-                /* We found it, but don't wont to overwrite */
-                return 0;
-            }
+    for (s = 0; s < n; s++) {
+        if (s < n - 1 && pipe2(fds, O_CLOEXEC) < 0) {
+            fprintf(stderr, "%s: %s\n", stages[s].argv[0], strerror(errno));
+            break;
         }
-    }
 
-    /* No entry has been found, just find the first empty spot */
-    for (i = 0; i < MAX_ENVS; i++) {
-        if ((env[i].name == NULL)) {
-            if ((env[i].name  = strdup(name)) == NULL) {
-                return -ENOMEM;
-            }
+        if (stages[s].builtin == NULL) {
+            pids[s] = Shell_SpawnStage(&stages[s], in, (s < n - 1) ? fds[1] : collect[1]);
+        } else if ((pids[s] = fork()) == 0) {
+            int saved[stages[s].command->nredirects + 1];
 
-            if ((env[i].value = strdup(value)) == NULL) {
-                free(env[i].name);
-                env[i].name = NULL;
-                return -ENOMEM;
+            if (in >= 0) {
+                dup2(in, STDIN_FILENO);
+                close(in);
             }
-            break;
+            if (s < n - 1) {
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+            } else if (collect[1] >= 0) {
+                dup2(collect[1], STDOUT_FILENO);
+            }
+            /* Or the collector would wait on every stage, not the last */
+            if (collect[1] >= 0) {
+                close(collect[0]);
+                close(collect[1]);
+            }
+            if (AST_ApplyRedirects(stages[s].program, stages[s].command, saved) < 0) {
+                _exit(1);
+            }
+
+            r = Shell_RunCommand(stages[s].builtin, stages[s].argc, stages[s].argv, false);
+            Sink_Flush(shell_sink);
+            _exit(r);
+        } else if (pids[s] < 0) {
+            fprintf(stderr, "%s: %s\n", stages[s].argv[0], strerror(errno));
+        }
+
+        if (in >= 0) {
+            close(in);
+            in = -1;
+        }
+        if (s < n - 1) {
+            close(fds[1]);
+            in = fds[0];
         }
     }
 
-    return 0;
-}
+    if (in >= 0) {
+        close(in);
+    }
 
-char *my_getenv(char *name)
-{
-    size_t i;
+    if (collect[0] >= 0) {
+        Source_t from = { collect[0], NULL };
 
-    for (i = 0; i < MAX_ENVS; i++) {
-        if (env[i].name && (strcmp(env[i].name, name) == 0)) {
-            return env[i].value;
-        }
+        close(collect[1]);
+        Command_CatFd(shell_sink, &from);
+        close(collect[0]);
     }
 
-    DTRACE("Unable to find %s\n", name);
+    /* The status of a pipeline is that of its last command */
+    while (s-- > 0) {
+        int status = (pids[s] < 0) ? Shell_SpawnStatus(pids[s]) : Shell_Wait(pids[s]);
 
-    return NULL;
-}
-
-int Command_Test(int argc, char *argv[])
-{
-    if (argc > 3 && (strcmp(argv[1], "-n") == 0)) {
-        /* Check for empty string */
-        return (argv[2][0] != 0);
-    } else if (argc >= 4 && (strcmp(argv[2], "-lt") == 0)) {
-        return (strtol(argv[1], NULL, 0) < strtol(argv[3], NULL, 0)) ? 0 : 1;
-    } else if (argc == 2) {
-        /* Check for empty string */
-        return (argv[1][0] != 0);
+        if (s == n - 1) {
+            r = status;
+        }
     }
 
-    return 0;
+    return r;
 }
 
-int Command_Echo(int argc, char *argv[])
+/* Runs on one of the pool's threads. Once done the iteration's output goes
+ * out along with any after it that were only waiting for this one */
+static void Shell_ForEachRun(void *arg, uint32_t i)
 {
-    int i;
+    Shell_ForEach_t   *each      = arg;
+    Shell_Iteration_t *iteration = &each->iterations[i];
+    Shell_Iteration_t *next;
+    Shell_Context_t   *context   = shell_context;
+    Sink_t            *sink      = shell_sink;
+    Var_Scope_t       *outer     = shell_scope;
+    Var_Scope_t        scope;
 
-    for (i = 1; i < argc; i++) {
-        printf("%s%s", argv[i], (i + 1 < argc) ? " " : "");
+    memset(&scope, 0, sizeof(scope));
+    scope.parent = each->scope;
+
+    if (Sink_Init(&iteration->out, -1) < 0 ||
+            (scope.store.vars = calloc(each->context->vars.nvars, sizeof(Var_t))) == NULL) {
+        fprintf(stderr, "for: %s\n", strerror(ENOMEM));
+        iteration->status = 1;
+    } else {
+        scope.store.nvars = each->context->vars.nvars;
+        shell_context = each->context;
+        shell_sink    = &iteration->out;
+        shell_scope   = &scope;
+
+        iteration->status = each->func(each->arg, i);
+
+        shell_context = context;
+        shell_sink    = sink;
+        shell_scope   = outer;
     }
-    printf("\n");
+    Var_Free(&scope.store);
 
-    return 0;
+    pthread_mutex_lock(&each->lock);
+    iteration->done = true;
+    while (each->emitted < each->n && (next = &each->iterations[each->emitted])->done) {
+        Sink_Write(each->out, next->out.buf, next->out.len);
+        Sink_Free(&next->out);
+        each->emitted++;
+    }
+    if (each->out->tty) {
+        Sink_Flush(each->out);
+    }
+    pthread_mutex_unlock(&each->lock);
 }
 
-int Command_Seq(int argc, char *argv[])
+/* Call func for every i below n on up to nworkers threads, 0 for one per
+ * processor. Each call sees the variables as they were when the loop began
+ * and what it assigns is its own. Its output is written out in order. Returns
+ * the status of the last */
+int Shell_ForEach(uint32_t n, uint32_t nworkers, int (*func)(void *arg, uint32_t i), void *arg)
 {
+    Shell_ForEach_t each;
+    Var_Scope_t    *scope;
+    int             r;
 
-    if (argc == 3) {
-        int low, high;
-        int i;
+    if (n == 0) {
+        return 0;
+    }
+    if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        nworkers = 1;
+    }
 
-        low  = strtol(argv[1], NULL, 0);
-        high = strtol(argv[2], NULL, 0);
+    if ((each.iterations = calloc(n, sizeof(*each.iterations))) == NULL) {
+        fprintf(stderr, "for: %s\n", strerror(ENOMEM));
+        return 1;
+    }
+    each.n       = n;
+    each.emitted = 0;
+    each.context = shell_context;
+    each.out     = shell_sink;
+    each.scope   = shell_scope;
+    each.func    = func;
+    each.arg     = arg;
+    pthread_mutex_init(&each.lock, NULL);
 
-        for (i = low; i <= high; i++) {
-            printf("%d\n", i);
-        }
+    /* Reading a variable can fill in its value, which has to be done before
+     * any number of threads are reading it at once */
+    Var_Settle(&shell_context->vars);
+    for (scope = shell_scope; scope; scope = scope->parent) {
+        Var_Settle(&scope->store);
+    }
 
-        printf("\n");
+    /* Tasks would find themselves in this thread's iteration */
+    if (!Shell_Parallel()) {
+        Task_Hold();
+    }
+    if (Pool_Run(n, nworkers, Shell_ForEachRun, &each) < 0) {
+        Pool_Run(n, 1, Shell_ForEachRun, &each);
+    }
+    if (!Shell_Parallel()) {
+        Task_Release();
     }
 
-    return 0;
-}
+    r = each.iterations[n - 1].status;
+    pthread_mutex_destroy(&each.lock);
+    free(each.iterations);
 
-int Command_True(int argc, char *argv[])
-{
-    return 0;
+    return r;
 }
 
-int Command_False(int argc, char *argv[])
+static int Shell_PipeRun(Shell_Stage_t *stages, int n)
 {
-    return 1;
+    if (Shell_PipeInProcess(stages, n)) {
+        return Shell_PipeThreads(stages, n);
+    }
+
+    return Shell_PipeProcesses(stages, n);
 }
 
-int Command_Sleep(int argc, char *argv[])
+/* While output is collected a job writes to a pipe of its own, which the
+ * shell reads as the job is waited for. An external command is spawned onto
+ * it, anything else runs in a child */
+static int Shell_CollectBackground(Shell_Stage_t *stages, int n)
 {
-    if (argc != 2) {
-        return -EINVAL;
+    pid_t pid;
+    int   collect[2];
+
+    if (pipe2(collect, O_CLOEXEC) < 0) {
+        fprintf(stderr, "%s: %s\n", stages[0].argv[0], strerror(errno));
+        return 1;
     }
 
-    sleep(strtol(argv[1], NULL, 0));
-    
-    return 0;
+    if (n == 1 && stages[0].builtin == NULL) {
+        pid = Shell_SpawnStage(&stages[0], -1, collect[1]);
+    } else if ((pid = fork()) == 0) {
+        int r;
+
+        dup2(collect[1], STDOUT_FILENO);
+        close(collect[0]);
+        close(collect[1]);
+
+        r = Shell_PipeRun(stages, n);
+        Sink_Flush(shell_sink);
+        _exit(r);
+    } else if (pid < 0) {
+        pid = -errno;
+        fprintf(stderr, "%s: %s\n", stages[0].argv[0], strerror(errno));
+    }
+    close(collect[1]);
+
+    if (pid < 0) {
+        close(collect[0]);
+        return Shell_SpawnStatus(pid);
+    }
+
+    return Shell_Background(pid, collect[0]);
 }
 
-int Shell_RunCommand(int argc, char *argv[], bool background)
+/* A pipeline ending in & runs as a whole in a child of its own */
+int Shell_RunPipeline(Shell_Stage_t *stages, int n)
 {
-    int i;
-    int r;
+    pid_t pid;
 
-    DTRACE("Running command ");
-    for (i = 0; i < argc; i++) {
-        DTRACE("'%s' ", argv[i]);
+    /* An iteration of a parallel for has nowhere to leave a job, it runs to
+     * the end */
+    if (!stages[n - 1].command->background || Shell_Parallel()) {
+        return Shell_PipeRun(stages, n);
     }
-    DTRACE("%s\n", background ? "in the background" : "");
-    DTRACE("\n");
 
-    if (strcmp(argv[0], "[") == 0) {
-        r = Command_Test(argc, argv);
-    } else if (strcmp(argv[0], "echo") == 0) {
-        r = Command_Echo(argc, argv);
-    } else if (strcmp(argv[0], "seq") == 0) {
-        r = Command_Seq(argc, argv);
-    } else if (strcmp(argv[0], "true") == 0) {
-        r = Command_True(argc, argv);
-    } else if (strcmp(argv[0], "false") == 0) {
-        r = Command_False(argc, argv);
-    } else if (strcmp(argv[0], "sleep") == 0) {
-        r = Command_Sleep(argc, argv);
-    } else {
-        fprintf(stderr, "%s: not found\n", argv[0]);
-        r = 1;
+    /* A builtin with the shell's fds stays in the shell as a task, its output
+     * goes where the shell's does */
+    if (Shell_Collecting()) {
+        if (n == 1 && stages[0].builtin && stages[0].command->nredirects == 0 &&
+                Shell_Task(stages[0].builtin, stages[0].argc, stages[0].argv) >= 0) {
+            return 0;
+        }
+        return Shell_CollectBackground(stages, n);
     }
 
-    /* Clean up */
-    for (i = 0; i < argc; i++) {
-        free(argv[i]);
+    Sink_Flush(shell_sink);
+    if ((pid = fork()) == 0) {
+        int r = Shell_PipeRun(stages, n);
+
+        Sink_Flush(shell_sink);
+        _exit(r);
+    } else if (pid < 0) {
+        fprintf(stderr, "%s: %s\n", stages[0].argv[0], strerror(errno));
+        return 1;
     }
-    free(argv);
 
-    return r;
+    return Shell_Background(pid, -1);
 }
 
-void Shell_ParseInput(Parser_t *parser)
+/* Returns the status of the last command, or 2 when input does not parse */
+int Shell_ParseInput(Parser_t *parser)
 {
-    AST_List_t *list;
+    AST_Program_t *program;
+    int            r;
 
     /* Reset the line */
-    parser->c        = parser->getchar(parser, 1000);
+    Scanner_Start(parser);
 
     /* Setup the first token */
     if ((parser->t = Scanner_TokenNext(parser)) == NULL) {
         fprintf(stderr, "No memory");
-        return;
+        return 1;
     }
 
     /* Start building the AST */
-    list = AST_ParseProgram(parser);
+    if ((program = AST_ParseProgram(parser)) == NULL) {
+        Arena_Reset(parser->arena);
+        return 2;
+    }
+
+    AST_PrintProgram(program);
+    r = AST_ProcessProgram(program);
+
+    /* Loops left running in the background go on using the program. Read a
+     * character at a time it is all in the arena, which they can have, the
+     * last of them frees it. A mapped script is only lent, they have to be
+     * done with it first */
+    if (program->refs > 0 &&
+            (parser->getchar == NULL || AST_DetachProgram(program) < 0)) {
+        Task_JoinAll();
+    }
+    if (!program->detached) {
+        AST_FreeProgram(program);
+    }
+
+    Sink_Flush(shell_sink);
+
+    return r;
+}
+
+int Shell_LineGetChar(struct Parser *parser, int timeout)
+{
+    (void) timeout;
+
+    if (*parser->LineChar == '\0') {
+        return EOF;
+    }
 
-    AST_PrintProgram(list);
-    AST_ProcessProgram(list);
-    AST_FreeProgram(list);
+    return (unsigned char) *parser->LineChar++;
 }
 
 void Shell_ParseLine(void) 
 {
     Parser_t parser;
+    Arena_t  arena;
     memset(&parser, 0, sizeof(parser));
+    memset(&arena, 0, sizeof(arena));
     char *prompt = ">";
+    char line[1024];
+
+    /* Each line reuses the memory of the one before */
+    parser.arena = &arena;
+
+    Sink_Printf(shell_sink, "%s ", prompt);
+    Sink_Flush(shell_sink);
+    for (;;) {
+        /* Background builtins run while the terminal is quiet, a line at a
+         * time is all it hands over so nothing is left waiting in stdin */
+        if (Task_Pending() && isatty(STDIN_FILENO)) {
+            Task_Block(STDIN_FILENO, -1);
+        }
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            break;
+        }
 
-    printf("%s ", prompt);
-    while (fgets(parser.line, sizeof(parser.line), stdin)) {
         parser.linenum  = 1;
         parser.colnum   = 1;
         parser.token_control = true;
+        parser.LineChar = line;
+        parser.getchar  = Shell_LineGetChar;
 
         Shell_ParseInput(&parser);
-        printf("%s ", prompt);
+
+        /* Collect jobs that finished while the line ran */
+        Job_Poll(shell_context->jobs, 0);
+
+        Sink_Printf(shell_sink, "%s ", prompt);
+        Sink_Flush(shell_sink);
     }
+
+    Arena_Free(&arena);
 }
 
-FILE *f;
 int Shell_FileGetChar(struct Parser *parser, int timeout)
 {
     (void) timeout;
-    return fgetc(f);
+    return fgetc(parser->file);
 }
 
-void Shell_ParseFile(char *file) 
+/* Scan len bytes of script in place, the scanner writes over them */
+static int Shell_ParseBuffer(char *script, size_t len)
 {
     Parser_t parser;
+    Arena_t  arena;
+    int      r;
+
     memset(&parser, 0, sizeof(parser));
+    memset(&arena, 0, sizeof(arena));
+    parser.arena     = &arena;
+    parser.linenum   = 1;
+    parser.colnum    = 1;
+    parser.token_control = true;
+    parser.input     = script;
+    parser.input_len = len;
 
-    f = fopen(file, "r");
-    if (f == NULL) {
-        return;
+    r = Shell_ParseInput(&parser);
+
+    Arena_Free(&arena);
+
+    return r;
+}
+
+int Shell_ParseFile(const char *file) 
+{
+    Parser_t parser;
+    Arena_t  arena;
+    struct stat st;
+    int   fd;
+    int   r;
+    char *map = MAP_FAILED;
+
+    if ((fd = open(file, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return 127;
+    }
+
+    /* Regular files are scanned in place, the mapping is private as the
+     * scanner terminates tokens by writing over their delimiters */
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
     }
 
+    if (map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        close(fd);
+
+        r = Shell_ParseBuffer(map, st.st_size);
+
+        munmap(map, st.st_size);
+        return r;
+    }
+
+    /* Pipes and the like are streamed a character at a time */
+    memset(&parser, 0, sizeof(parser));
+    memset(&arena, 0, sizeof(arena));
+    parser.arena    = &arena;
     parser.linenum  = 1;
     parser.colnum   = 1;
     parser.token_control = true;
     parser.getchar  = Shell_FileGetChar;
 
-    Shell_ParseInput(&parser);
+    if ((parser.file = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return 127;
+    }
+
+    r = Shell_ParseInput(&parser);
+
+    fclose(parser.file);
+    Arena_Free(&arena);
+
+    return r;
+}
+
+/****************************************************************************/
+/* A child only ever writes what it was forked to, to its own stdout, even
+ * when the shell it was forked from collects its output */
+static void Shell_AtFork(void)
+{
+    Shell_Context_t *shell = shell_context;
+
+    if (shell) {
+        shell->out.fd   = STDOUT_FILENO;
+        shell->out.ring = NULL;
+        shell->out.len  = 0;
+        shell_sink = &shell->out;
+    }
+}
+
+static void Shell_Once(void)
+{
+    Shell_BuiltinInit();
+    Task_Local(Shell_TaskSwap);
+    pthread_atfork(NULL, NULL, Shell_AtFork);
+}
+
+/* Output goes to fd, or is collected for Shell_Output when fd is -1 */
+Shell_Context_t *Shell_New(int fd)
+{
+    Shell_Context_t *shell;
+
+    pthread_once(&shell_once, Shell_Once);
+
+    if ((shell = calloc(1, sizeof(*shell))) == NULL) {
+        return NULL;
+    }
+    shell->in.fd = STDIN_FILENO;
+
+    if (Sink_Init(&shell->out, fd) < 0 ||
+            (shell->jobs = Job_New(&shell->out)) == NULL ||
+            (shell->paths = Path_New()) == NULL ||
+            (shell->path = Var_Slot(&shell->vars, "PATH")) < 0 ||
+            (shell->bang = Var_Slot(&shell->vars, "!")) < 0) {
+        Shell_Free(shell);
+        return NULL;
+    }
+
+    return shell;
+}
+
+/* Anything still buffered is written out, background jobs are reaped */
+void Shell_Free(Shell_Context_t *shell)
+{
+    if (shell == NULL) {
+        return;
+    }
+
+    /* Jobs writing to a shell that collects its output have nowhere else to
+     * write, they finish first */
+    if (shell->jobs && shell->out.fd < 0) {
+        Job_WaitAll(shell->jobs);
+    }
+    Job_Free(shell->jobs);
+    Path_Free(shell->paths);
+    Var_Free(&shell->vars);
+    Sink_Free(&shell->out);
+    free(shell);
+}
+
+/* Make shell the one this thread runs */
+static void Shell_Enter(Shell_Context_t *shell, Shell_Saved_t *saved)
+{
+    saved->context = shell_context;
+    saved->sink    = shell_sink;
+    saved->scope   = shell_scope;
+
+    shell_context = shell;
+    shell_sink    = &shell->out;
+    shell_scope   = NULL;
+
+    Task_Init();
+}
+
+/* Builtins left running in the background finish before the shell is put
+ * down. So do jobs when output is collected, it has to be all there for
+ * Shell_Output */
+static void Shell_Leave(Shell_Saved_t *saved)
+{
+    Task_JoinAll();
+    if (Shell_Collecting()) {
+        Job_WaitAll(shell_context->jobs);
+    }
+    Sink_Flush(shell_sink);
+
+    shell_context = saved->context;
+    shell_sink    = saved->sink;
+    shell_scope   = saved->scope;
+}
+
+/* Run the script in file, returns the status of its last command */
+int Shell_RunFile(Shell_Context_t *shell, const char *file)
+{
+    Shell_Saved_t saved;
+    int           r;
+
+    Shell_Enter(shell, &saved);
+    r = Shell_ParseFile(file);
+    Shell_Leave(&saved);
+
+    return r;
+}
+
+int Shell_RunString(Shell_Context_t *shell, const char *script)
+{
+    Shell_Saved_t saved;
+    size_t        len = strlen(script);
+    char         *copy;
+    int           r;
+
+    if (len == 0) {
+        return 0;
+    }
+    if ((copy = malloc(len)) == NULL) {
+        return 1;
+    }
+    memcpy(copy, script, len);
+
+    Shell_Enter(shell, &saved);
+    r = Shell_ParseBuffer(copy, len);
+    Shell_Leave(&saved);
+
+    free(copy);
+
+    return r;
+}
+
+int Shell_SetVar(Shell_Context_t *shell, const char *name, const char *value)
+{
+    int slot;
+
+    if ((slot = Var_Slot(&shell->vars, name)) < 0) {
+        return slot;
+    }
+    if (slot == shell->path) {
+        Path_Flush(shell->paths);
+    }
+
+    return Var_Set(&shell->vars, slot, value);
+}
+
+/* NULL when name is not set */
+const char *Shell_GetVar(Shell_Context_t *shell, const char *name)
+{
+    int slot;
+
+    if ((slot = Var_Find(&shell->vars, name, Shell_Hash(name))) < 0) {
+        return NULL;
+    }
+
+    return Var_Get(&shell->vars, slot);
+}
+
+/* What a shell made with fd -1 has written so far, nul terminated */
+const char *Shell_Output(Shell_Context_t *shell, size_t *len)
+{
+    if (Sink_Reserve(&shell->out, 1) < 0) {
+        return NULL;
+    }
+    shell->out.buf[shell->out.len] = '\0';
+    *len = shell->out.len;
+
+    return shell->out.buf;
+}
+
+/* Runs on one of the pool's threads */
+static void Shell_BatchRun(void *arg, uint32_t i)
+{
+    Shell_Batch_t  *batch  = arg;
+    Shell_Script_t *script = &batch->scripts[i];
+    Shell_Script_t *next;
+    const char     *output;
+    size_t          len;
+
+    if ((script->shell = Shell_New(-1)) == NULL) {
+        fprintf(stderr, "%s: %s\n", script->file, strerror(ENOMEM));
+        script->status = 1;
+    } else {
+        script->status = Shell_RunFile(script->shell, script->file);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    script->done = true;
+    while (batch->emitted < batch->n && (next = &batch->scripts[batch->emitted])->done) {
+        if (next->shell && (output = Shell_Output(next->shell, &len))) {
+            Sink_Write(&batch->out, output, len);
+        }
+        Sink_Flush(&batch->out);
+        Shell_Free(next->shell);
+        next->shell = NULL;
+        batch->emitted++;
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* Run every file on up to nworkers threads, 0 for one per processor, each in
+ * a shell of its own. The output of each comes out whole and in the order
+ * given. Only stdout is held back, stderr is the process's and what goes to
+ * it from different files can be interleaved. Returns 0 when all of them
+ * succeed, or the status of the first that did not */
+static int Shell_Batch(char *const files[], uint32_t n, uint32_t nworkers)
+{
+    Shell_Batch_t batch;
+    uint32_t      i;
+    int           r = 0;
+
+    if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        nworkers = 1;
+    }
+
+    if ((batch.scripts = calloc(n, sizeof(*batch.scripts))) == NULL ||
+            Sink_Init(&batch.out, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "shell: %s\n", strerror(ENOMEM));
+        free(batch.scripts);
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        batch.scripts[i].file = files[i];
+    }
+    batch.n       = n;
+    batch.emitted = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    if (Pool_Run(n, nworkers, Shell_BatchRun, &batch) < 0) {
+        Pool_Run(n, 1, Shell_BatchRun, &batch);
+    }
+
+    for (i = 0; i < n && r == 0; i++) {
+        r = batch.scripts[i].status;
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    Sink_Free(&batch.out);
+    free(batch.scripts);
+
+    return r;
+}
+
+static int Shell_Usage(void)
+{
+    fprintf(stderr, "usage: shell [file ...]\n"
+                    "       shell -j N file ...\n"
+                    "  -j N  run the files N at a time, 0 for one per processor,\n"
+                    "        each in a shell of its own. The stdout of each is\n"
+                    "        written out whole in the order given, stderr is not\n");
 
-    fclose(f);
+    return 2;
 }
 
+/* shell [-j N] [file ...], with -j each file runs in a shell of its own, N at
+ * a time */
 int main(int argc, char *argv[]) 
 {
-    if (argc == 1) {
+    Shell_Context_t *shell;
+    Shell_Saved_t    saved;
+    const char      *jobs = NULL;
+    char            *end;
+    long             nworkers = 0;
+    int              r = 0;
+    int              i = 1;
+
+    if (i < argc && strncmp(argv[i], "-j", 2) == 0) {
+        jobs = argv[i++] + 2;
+        if (*jobs == '\0') {
+            jobs = (i < argc) ? argv[i++] : "";
+        }
+        nworkers = strtol(jobs, &end, 10);
+        if (!isdigit((unsigned char) *jobs) || *end != '\0' || nworkers > UINT32_MAX) {
+            fprintf(stderr, "shell: -j %s: not a number of workers\n", jobs);
+            return Shell_Usage();
+        }
+    }
+
+    if (jobs) {
+        if (i == argc) {
+            fprintf(stderr, "shell: -j needs files to run\n");
+            return Shell_Usage();
+        }
+        return Shell_Batch(&argv[i], argc - i, nworkers);
+    }
+
+    if ((shell = Shell_New(STDOUT_FILENO)) == NULL) {
+        return 1;
+    }
+
+    if (i == argc) {
+        Shell_Enter(shell, &saved);
         Shell_ParseLine();
+        Shell_Leave(&saved);
     } else {
-        int i;
-        for (i = 1; i < argc; i++) {
-            Shell_ParseFile(argv[1]);
+        /* One after another in the one shell, each sees what those before
+         * it left behind */
+        for (; i < argc; i++) {
+            int status = Shell_RunFile(shell, argv[i]);
+
+            if (r == 0) {
+                r = status;
+            }
         }
     }
-    env_cleanup();
+    Shell_Free(shell);
 
-	return 0;
+	return r;
 }
 
 //------------------------------------------------------------------------------
-
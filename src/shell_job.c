@@ -0,0 +1,335 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       shell_job.c
+//  Description:    Commands left running in the background with &
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+typedef struct {
+    pid_t pid;
+    int   pidfd;                /* Readable once the job exits, -1 without */
+    int   out;                  /* What it writes while output is collected, -1 without */
+    int   status;               /* JOB_RUNNING until it has been reaped */
+} Job_t;
+
+#define JOB_RUNNING -1
+
+/* Jobs stay in the table once they finish, until a wait collects them. Each
+ * shell has its own */
+struct Job_Table {
+    Job_t    *jobs;
+    Sink_t   *out;              /* Where a job's output is read into */
+    uint32_t  njobs;
+    uint32_t  maxjobs;
+};
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+/* The status of a finished child the way $? has it */
+int Job_Status(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* An fd that is readable once pid exits. Older kernels have no pidfd, those
+ * children are only reaped by waiting */
+int Job_Pidfd(pid_t pid)
+{
+    int fd = -1;
+
+#ifdef SYS_pidfd_open
+    if ((fd = syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return fd;
+}
+
+/* What jobs write to a pipe of their own is read into out as they are
+ * waited for */
+Job_Table_t *Job_New(Sink_t *out)
+{
+    Job_Table_t *table;
+
+    if ((table = calloc(1, sizeof(Job_Table_t)))) {
+        table->out = out;
+    }
+
+    return table;
+}
+
+/* out is the read end of the job's stdout, or -1 when it has the shell's */
+int Job_Add(Job_Table_t *table, pid_t pid, int out)
+{
+    Job_t   *job;
+    uint32_t n;
+
+    if (table->njobs == table->maxjobs) {
+        n = table->maxjobs ? 2*table->maxjobs : 16;
+        if ((job = realloc(table->jobs, n*sizeof(*job))) == NULL) {
+            return -ENOMEM;
+        }
+        table->jobs    = job;
+        table->maxjobs = n;
+    }
+
+    job = &table->jobs[table->njobs++];
+    job->pid    = pid;
+    job->pidfd  = Job_Pidfd(pid);
+    job->out    = out;
+    job->status = JOB_RUNNING;
+
+    /* Tasks carry on while there is nothing to read */
+    if (out >= 0) {
+        fcntl(out, F_SETFL, O_NONBLOCK);
+    }
+
+    DTRACE("%s: [%u] %d\n", __func__, table->njobs, pid);
+
+    return 0;
+}
+
+static bool Job_Reap(Job_t *job, int options)
+{
+    int status;
+    pid_t r;
+
+    while ((r = waitpid(job->pid, &status, options)) < 0 && errno == EINTR)
+        ;
+    if (r == 0) {
+        return false;
+    }
+
+    /* Someone else collected it, there is no status to be had */
+    job->status = (r < 0) ? 127 : Job_Status(status);
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+
+    return true;
+}
+
+/* Wait up to timeout ms, -1 for ever, for any running job to finish and
+ * reap every one that has. Returns how many were reaped */
+int Job_Poll(Job_Table_t *table, int timeout)
+{
+    struct pollfd fds[table->njobs + 1];
+    Job_t   *waits[table->njobs + 1];
+    uint32_t nfds = 0;
+    uint32_t i;
+    int      reaped = 0;
+
+    for (i = 0; i < table->njobs; i++) {
+        Job_t *job = &table->jobs[i];
+
+        if (job->status != JOB_RUNNING) {
+            continue;
+        }
+
+        if (job->pidfd < 0) {
+            /* Nothing to poll, block on the first of these if told to wait.
+             * One whose output is still to be read may never finish */
+            if (Job_Reap(job, (timeout != 0 && nfds == 0 && reaped == 0 && job->out < 0) ?
+                        0 : WNOHANG)) {
+                reaped++;
+                timeout = 0;
+            }
+            continue;
+        }
+
+        fds[nfds].fd     = job->pidfd;
+        fds[nfds].events = POLLIN;
+        waits[nfds++]    = job;
+    }
+
+    if (nfds == 0) {
+        return reaped;
+    }
+
+    while (poll(fds, nfds, timeout) < 0) {
+        if (errno != EINTR) {
+            return reaped;
+        }
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].revents && Job_Reap(waits[i], WNOHANG)) {
+            reaped++;
+        }
+    }
+
+    return reaped;
+}
+
+static void Job_Remove(Job_Table_t *table, uint32_t i)
+{
+    if (table->jobs[i].out >= 0) {
+        close(table->jobs[i].out);
+    }
+    memmove(&table->jobs[i], &table->jobs[i + 1],
+            (table->njobs - i - 1) * sizeof(table->jobs[0]));
+    table->njobs--;
+}
+
+/* Returns the index of pid in the table, or -1 */
+static int Job_Find(Job_Table_t *table, pid_t pid)
+{
+    uint32_t i;
+
+    for (i = 0; i < table->njobs; i++) {
+        if (table->jobs[i].pid == pid) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Read what the job started as pid writes until it is done writing. Tasks
+ * carry on while there is nothing to read, another may be reading it too */
+static void Job_Drain(Job_Table_t *table, pid_t pid)
+{
+    Sink_t *out = table->out;
+    ssize_t n;
+    int     fd;
+    int     i;
+
+    while ((i = Job_Find(table, pid)) >= 0 && (fd = table->jobs[i].out) >= 0) {
+        Task_Block(fd, -1);
+        if ((i = Job_Find(table, pid)) < 0 || table->jobs[i].out != fd) {
+            return;
+        }
+
+        if (Sink_Reserve(out, SINK_SIZE_MIN) < 0) {
+            n = 0;
+        } else if ((n = read(fd, &out->buf[out->len], out->size - out->len)) < 0 &&
+                (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+
+        if (n <= 0) {
+            close(fd);
+            table->jobs[i].out = -1;
+        } else {
+            out->len += n;
+        }
+    }
+}
+
+/* Wait for job to finish. Tasks carry on in the meantime, so the table may
+ * have changed by the time this returns */
+static void Job_Block(Job_Table_t *table, Job_t *job)
+{
+    if (job->out >= 0) {
+        Job_Drain(table, job->pid);
+        return;
+    }
+
+    if (job->pidfd < 0) {
+        Job_Poll(table, -1);
+        return;
+    }
+
+    Task_Block(job->pidfd, -1);
+    Job_Poll(table, 0);
+}
+
+/* Wait for the job started as pid, and forget it. Returns its status, or
+ * -ECHILD when pid is not a job */
+int Job_Wait(Job_Table_t *table, pid_t pid)
+{
+    int i;
+    int status;
+
+    if ((i = Job_Find(table, pid)) < 0) {
+        return -ECHILD;
+    }
+
+    while (table->jobs[i].status == JOB_RUNNING || table->jobs[i].out >= 0) {
+        Job_Block(table, &table->jobs[i]);
+
+        /* Another task's wait may have taken it */
+        if ((i = Job_Find(table, pid)) < 0) {
+            return -ECHILD;
+        }
+    }
+    status = table->jobs[i].status;
+    Job_Remove(table, i);
+
+    return status;
+}
+
+/* Wait for every job and forget them all */
+void Job_WaitAll(Job_Table_t *table)
+{
+    uint32_t i;
+
+    for (i = 0; i < table->njobs; ) {
+        if (table->jobs[i].status == JOB_RUNNING || table->jobs[i].out >= 0) {
+            Job_Block(table, &table->jobs[i]);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    table->njobs = 0;
+}
+
+/* Reap whatever has finished and let go of the table */
+void Job_Free(Job_Table_t *table)
+{
+    uint32_t i;
+
+    if (table == NULL) {
+        return;
+    }
+
+    Job_Poll(table, 0);
+    for (i = 0; i < table->njobs; i++) {
+        if (table->jobs[i].pidfd >= 0) {
+            close(table->jobs[i].pidfd);
+        }
+        if (table->jobs[i].out >= 0) {
+            close(table->jobs[i].out);
+        }
+    }
+    free(table->jobs);
+    free(table);
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,278 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       shell_path.c
+//  Description:    Finds commands on PATH, remembering where they were
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+typedef struct {
+    char     *name;             /* NULL when the entry is empty */
+    char     *path;
+    uint32_t  hash;
+} Path_Entry_t;
+
+/* Open addressed on the name, kept at most half full. Entries are only ever
+ * added, a change of PATH throws the lot away. Each shell has its own, the
+ * lock is only for the iterations of a parallel for looking commands up at
+ * once. Paths handed out stay put until the cache is flushed, which they
+ * never do */
+struct Path_Cache {
+    Path_Entry_t   *entries;
+    uint32_t        nentries;
+    uint32_t        size;       /* Power of two */
+    pthread_mutex_t lock;
+};
+
+#define PATH_CACHE_MIN  32
+#define PATH_DEFAULT    "/usr/local/bin:/usr/bin:/bin"
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+uint32_t Shell_Hash(const char *s);
+char *my_getenv(char *name);
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+Path_Cache_t *Path_New(void)
+{
+    Path_Cache_t *cache;
+
+    if ((cache = calloc(1, sizeof(*cache))) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+static Path_Entry_t *Path_Find(Path_Cache_t *cache, const char *name, uint32_t hash)
+{
+    uint32_t i;
+
+    if (cache->size == 0) {
+        return NULL;
+    }
+
+    for (i = hash & (cache->size - 1); cache->entries[i].name;
+            i = (i + 1) & (cache->size - 1)) {
+        if (cache->entries[i].hash == hash &&
+                strcmp(cache->entries[i].name, name) == 0) {
+            return &cache->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int Path_Grow(Path_Cache_t *cache)
+{
+    uint32_t      size = cache->size ? 2*cache->size : PATH_CACHE_MIN;
+    Path_Entry_t *entries;
+    uint32_t      i;
+    uint32_t      j;
+
+    if ((entries = calloc(size, sizeof(*entries))) == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < cache->size; i++) {
+        if (cache->entries[i].name) {
+            for (j = cache->entries[i].hash & (size - 1); entries[j].name; j = (j + 1) & (size - 1))
+                ;
+            entries[j] = cache->entries[i];
+        }
+    }
+
+    free(cache->entries);
+    cache->entries = entries;
+    cache->size    = size;
+
+    return 0;
+}
+
+static const char *Path_Add(Path_Cache_t *cache, const char *name, uint32_t hash, const char *path)
+{
+    Path_Entry_t *entry;
+    uint32_t      i;
+
+    if (2*(cache->nentries + 1) > cache->size && Path_Grow(cache) < 0) {
+        return NULL;
+    }
+
+    for (i = hash & (cache->size - 1); cache->entries[i].name; i = (i + 1) & (cache->size - 1))
+        ;
+    entry = &cache->entries[i];
+
+    if ((entry->name = strdup(name)) == NULL) {
+        return NULL;
+    }
+    if ((entry->path = strdup(path)) == NULL) {
+        free(entry->name);
+        entry->name = NULL;
+        return NULL;
+    }
+    entry->hash = hash;
+    cache->nentries++;
+
+    return entry->path;
+}
+
+/* The shell's own PATH, then the one it was started with */
+static const char *Path_Dirs(void)
+{
+    const char *dirs;
+
+    if ((dirs = my_getenv("PATH")) == NULL && (dirs = getenv("PATH")) == NULL) {
+        dirs = PATH_DEFAULT;
+    }
+
+    return dirs;
+}
+
+/* Walk dirs for name, writing the first executable file into buf */
+static bool Path_Search(const char *dirs, const char *name, char *buf, size_t size)
+{
+    const char  *dir = dirs;
+    const char  *end;
+    size_t       len;
+    struct stat  st;
+
+    for (;; dir = end + 1) {
+        if ((end = strchr(dir, ':')) == NULL) {
+            end = dir + strlen(dir);
+        }
+
+        /* An empty entry is the current directory */
+        len = end - dir;
+        if (len == 0) {
+            snprintf(buf, size, "%s", name);
+        } else if (snprintf(buf, size, "%.*s/%s", (int) len, dir, name) >= (int) size) {
+            goto next;
+        }
+
+        if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) {
+            return true;
+        }
+
+next:
+        if (*end == '\0') {
+            return false;
+        }
+    }
+}
+
+/* Returns where name runs from, or NULL when it is nowhere on PATH. A name
+ * with a / in it is taken as it is */
+const char *Path_Lookup(Path_Cache_t *cache, const char *name)
+{
+    uint32_t      hash;
+    Path_Entry_t *entry;
+    const char   *path;
+    char          buf[PATH_MAX];
+
+    if (strchr(name, '/')) {
+        return name;
+    }
+    if (name[0] == '\0') {
+        return NULL;
+    }
+
+    hash = Shell_Hash(name);
+    pthread_mutex_lock(&cache->lock);
+
+    if ((entry = Path_Find(cache, name, hash))) {
+        path = entry->path;
+    } else if (Path_Search(Path_Dirs(), name, buf, sizeof(buf))) {
+        path = Path_Add(cache, name, hash, buf);
+    } else {
+        /* Misses are not kept, the command may be installed later */
+        DTRACE("%s: %s not found\n", __func__, name);
+        path = NULL;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return path;
+}
+
+/* Path_Lookup for a PATH other than the shell's, dirs, without the cache.
+ * The result is in buf unless name had a / */
+const char *Path_Resolve(const char *dirs, const char *name, char *buf, size_t size)
+{
+    if (strchr(name, '/')) {
+        return name;
+    }
+    if (name[0] == '\0') {
+        return NULL;
+    }
+
+    return Path_Search(dirs, name, buf, size) ? buf : NULL;
+}
+
+/* Forget everything, for when PATH changes or hash -r */
+void Path_Flush(Path_Cache_t *cache)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache->size; i++) {
+        free(cache->entries[i].name);
+        free(cache->entries[i].path);
+    }
+    free(cache->entries);
+    cache->entries  = NULL;
+    cache->nentries = 0;
+    cache->size     = 0;
+}
+
+void Path_Free(Path_Cache_t *cache)
+{
+    if (cache) {
+        Path_Flush(cache);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+/* Every remembered command */
+int Path_Print(Path_Cache_t *cache, Sink_t *out)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache->size; i++) {
+        if (cache->entries[i].name) {
+            Sink_Printf(out, "%s\t%s\n", cache->entries[i].name, cache->entries[i].path);
+        }
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
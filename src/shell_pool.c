@@ -0,0 +1,175 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       shell_pool.c
+//  Description:    Runs the iterations of a loop across a pool of threads
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+/* The iterations a worker has left, lo in the low half and hi in the high.
+ * The owner takes from lo and thieves take from hi, both by swapping the
+ * whole word, so neither can take what the other has */
+typedef struct {
+    _Atomic uint64_t range;
+    pthread_t        thread;
+    struct Pool     *pool;
+    uint32_t         id;
+} __attribute__((aligned(64))) Pool_Worker_t;
+
+typedef struct Pool {
+    Pool_Worker_t  *workers;
+    uint32_t        nworkers;
+    void          (*func)(void *arg, uint32_t i);
+    void           *arg;
+} Pool_t;
+
+#define POOL_RANGE(lo, hi)  (((uint64_t) (hi) << 32) | (lo))
+#define POOL_LO(range)      ((uint32_t) (range))
+#define POOL_HI(range)      ((uint32_t) ((range) >> 32))
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+/* Take the next of this worker's own iterations, false when it has none */
+static bool Pool_Pop(Pool_Worker_t *worker, uint32_t *i)
+{
+    uint64_t range = atomic_load(&worker->range);
+
+    do {
+        if (POOL_LO(range) >= POOL_HI(range)) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&worker->range, &range,
+                POOL_RANGE(POOL_LO(range) + 1, POOL_HI(range))));
+
+    *i = POOL_LO(range);
+
+    return true;
+}
+
+/* Take the top half of the victim's iterations for worker, which has none
+ * left of its own */
+static bool Pool_Steal(Pool_Worker_t *worker, Pool_Worker_t *victim)
+{
+    uint64_t range = atomic_load(&victim->range);
+    uint32_t half;
+
+    do {
+        if (POOL_LO(range) >= POOL_HI(range)) {
+            return false;
+        }
+        half = (POOL_HI(range) - POOL_LO(range) + 1) / 2;
+    } while (!atomic_compare_exchange_weak(&victim->range, &range,
+                POOL_RANGE(POOL_LO(range), POOL_HI(range) - half)));
+
+    atomic_store(&worker->range, POOL_RANGE(POOL_HI(range) - half, POOL_HI(range)));
+
+    DTRACE("%s: %u took %u from %u\n", __func__, worker->id, half, victim->id);
+
+    return true;
+}
+
+static void *Pool_Work(void *arg)
+{
+    Pool_Worker_t *worker = arg;
+    Pool_t        *pool   = worker->pool;
+    uint32_t       i;
+    uint32_t       v;
+
+    for (;;) {
+        while (Pool_Pop(worker, &i)) {
+            pool->func(pool->arg, i);
+        }
+
+        /* Once every queue is empty whatever is left is already running */
+        for (v = 1; v < pool->nworkers; v++) {
+            if (Pool_Steal(worker, &pool->workers[(worker->id + v) % pool->nworkers])) {
+                break;
+            }
+        }
+        if (v == pool->nworkers) {
+            return NULL;
+        }
+    }
+}
+
+/* Call func for every i below n, on up to nworkers threads counting this
+ * one. Each starts with an even share and takes from the others once its
+ * own has gone. Returns once every call has */
+int Pool_Run(uint32_t n, uint32_t nworkers, void (*func)(void *arg, uint32_t i), void *arg)
+{
+    Pool_t   pool;
+    uint32_t started;
+    uint32_t w;
+
+    if (nworkers > n) {
+        nworkers = n;
+    }
+    if (nworkers <= 1) {
+        for (w = 0; w < n; w++) {
+            func(arg, w);
+        }
+        return 0;
+    }
+
+    if ((pool.workers = aligned_alloc(64, nworkers * sizeof(*pool.workers))) == NULL) {
+        return -ENOMEM;
+    }
+    pool.nworkers = nworkers;
+    pool.func     = func;
+    pool.arg      = arg;
+
+    for (w = 0; w < nworkers; w++) {
+        pool.workers[w].pool = &pool;
+        pool.workers[w].id   = w;
+        atomic_init(&pool.workers[w].range, POOL_RANGE((uint64_t) n * w / nworkers,
+                    (uint64_t) n * (w + 1) / nworkers));
+    }
+
+    /* Any that fail to start have their share stolen by the rest */
+    for (started = 1; started < nworkers; started++) {
+        if (pthread_create(&pool.workers[started].thread, NULL, Pool_Work,
+                    &pool.workers[started]) != 0) {
+            break;
+        }
+    }
+
+    Pool_Work(&pool.workers[0]);
+
+    while (--started > 0) {
+        pthread_join(pool.workers[started].thread, NULL);
+    }
+    free(pool.workers);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,222 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       shell_ring.c
+//  Description:    Ring buffers between the stages of a pipeline
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <libraries/parser.h>
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+enum {
+    RING_READER,
+    RING_WRITER,
+};
+
+/* head and tail count every byte that has gone through, so they only ever
+ * move forwards and head - tail is what is held. One side sleeps on its wake
+ * count when it can not go on, the other bumps it after moving on if the
+ * waiting bit says anyone is there */
+struct Ring {
+    char             *buf;
+    uint32_t          size;         /* Power of two */
+    _Atomic uint32_t  head;         /* Only written by the writer */
+    _Atomic uint32_t  tail;         /* Only written by the reader */
+    _Atomic uint32_t  closed;       /* Bit for each side that has gone */
+    _Atomic uint32_t  waiting;      /* Bit for each side about to sleep */
+    _Atomic uint32_t  wake[2];
+};
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+Ring_t *Ring_New(void)
+{
+    Ring_t *ring;
+
+    if ((ring = calloc(1, sizeof(*ring))) == NULL) {
+        return NULL;
+    }
+    if ((ring->buf = malloc(RING_SIZE)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->size = RING_SIZE;
+
+    return ring;
+}
+
+void Ring_Free(Ring_t *ring)
+{
+    if (ring) {
+        free(ring->buf);
+        free(ring);
+    }
+}
+
+/* Sleep until the other side bumps wake, unless it already has */
+static void Ring_Wait(Ring_t *ring, int side, uint32_t seq)
+{
+    syscall(SYS_futex, &ring->wake[side], FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+}
+
+static void Ring_Wake(Ring_t *ring, int side)
+{
+    if (atomic_load(&ring->waiting) & (1u << side)) {
+        atomic_fetch_add(&ring->wake[side], 1);
+        syscall(SYS_futex, &ring->wake[side], FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Returns 0 once all of data is in the ring, or -EPIPE when the reader has
+ * gone */
+int Ring_Write(Ring_t *ring, const void *data, size_t n)
+{
+    const char *p = data;
+    uint32_t    head;
+    uint32_t    space;
+    uint32_t    chunk;
+    uint32_t    off;
+    uint32_t    seq;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (n > 0) {
+        seq   = atomic_load(&ring->wake[RING_WRITER]);
+        space = ring->size - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+
+        if (atomic_load(&ring->closed) & (1u << RING_READER)) {
+            return -EPIPE;
+        }
+
+        if (space == 0) {
+            atomic_fetch_or(&ring->waiting, 1u << RING_WRITER);
+            if (head - atomic_load(&ring->tail) == ring->size &&
+                    !(atomic_load(&ring->closed) & (1u << RING_READER))) {
+                Ring_Wait(ring, RING_WRITER, seq);
+            }
+            atomic_fetch_and(&ring->waiting, ~(1u << RING_WRITER));
+            continue;
+        }
+
+        chunk = (n < space) ? n : space;
+        off   = head & (ring->size - 1);
+        if (chunk <= ring->size - off) {
+            memcpy(&ring->buf[off], p, chunk);
+        } else {
+            memcpy(&ring->buf[off], p, ring->size - off);
+            memcpy(ring->buf, p + ring->size - off, chunk - (ring->size - off));
+        }
+
+        head += chunk;
+        atomic_store(&ring->head, head);
+        Ring_Wake(ring, RING_READER);
+
+        p += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+}
+
+/* Returns up to n bytes, waiting for at least one, or 0 once the writer has
+ * gone and everything it wrote has been read */
+ssize_t Ring_Read(Ring_t *ring, void *buf, size_t n)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t held;
+    uint32_t off;
+    uint32_t seq;
+
+    for (;;) {
+        seq = atomic_load(&ring->wake[RING_READER]);
+
+        if ((held = atomic_load_explicit(&ring->head, memory_order_acquire) - tail) > 0) {
+            break;
+        }
+
+        /* The writer closes after its last write, so look again */
+        if (atomic_load(&ring->closed) & (1u << RING_WRITER)) {
+            if ((held = atomic_load(&ring->head) - tail) > 0) {
+                break;
+            }
+            return 0;
+        }
+
+        atomic_fetch_or(&ring->waiting, 1u << RING_READER);
+        if (atomic_load(&ring->head) == tail &&
+                !(atomic_load(&ring->closed) & (1u << RING_WRITER))) {
+            Ring_Wait(ring, RING_READER, seq);
+        }
+        atomic_fetch_and(&ring->waiting, ~(1u << RING_READER));
+    }
+
+    if (n > held) {
+        n = held;
+    }
+    off = tail & (ring->size - 1);
+    if (n <= ring->size - off) {
+        memcpy(buf, &ring->buf[off], n);
+    } else {
+        memcpy(buf, &ring->buf[off], ring->size - off);
+        memcpy((char *) buf + ring->size - off, ring->buf, n - (ring->size - off));
+    }
+
+    atomic_store(&ring->tail, tail + n);
+    Ring_Wake(ring, RING_WRITER);
+
+    return n;
+}
+
+/* Nothing more is coming */
+void Ring_CloseWrite(Ring_t *ring)
+{
+    atomic_fetch_or(&ring->closed, 1u << RING_WRITER);
+    Ring_Wake(ring, RING_READER);
+}
+
+/* Nothing more will be read, the writer gets -EPIPE */
+void Ring_CloseRead(Ring_t *ring)
+{
+    atomic_fetch_or(&ring->closed, 1u << RING_READER);
+    Ring_Wake(ring, RING_WRITER);
+}
+
+/****************************************************************************/
+ssize_t Source_Read(Source_t *in, void *buf, size_t n)
+{
+    ssize_t r;
+
+    if (in->ring) {
+        return Ring_Read(in->ring, buf, n);
+    }
+
+    while ((r = read(in->fd, buf, n)) < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+
+    return r;
+}
+
+//------------------------------------------------------------------------------
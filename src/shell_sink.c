@@ -0,0 +1,212 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       shell_sink.c
+//  Description:    Buffered output for builtins
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <libraries/parser.h>
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+
+/****************************************************************************/
+/* Output to fd, or collected in memory when fd is -1 */
+int Sink_Init(Sink_t *sink, int fd)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd  = fd;
+    sink->tty = (fd >= 0) && isatty(fd);
+
+    /* Collected output starts small and grows */
+    sink->size = (fd >= 0) ? SINK_SIZE : SINK_SIZE_MIN;
+    if ((sink->buf = malloc(sink->size)) == NULL) {
+        sink->size = 0;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Output for the next stage of a pipeline */
+int Sink_InitRing(Sink_t *sink, Ring_t *ring)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd   = -1;
+    sink->ring = ring;
+    sink->size = SINK_SIZE;
+    if ((sink->buf = malloc(sink->size)) == NULL) {
+        sink->size = 0;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void Sink_Free(Sink_t *sink)
+{
+    Sink_Flush(sink);
+    free(sink->buf);
+    sink->buf  = NULL;
+    sink->size = 0;
+    sink->len  = 0;
+}
+
+/* Output goes somewhere rather than being collected */
+static bool Sink_Streams(Sink_t *sink)
+{
+    return (sink->fd >= 0) || sink->ring;
+}
+
+/* Write out iov in full, carrying on after partial writes */
+static int Sink_Writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *) iov->iov_base + n;
+            iov->iov_len  -= n;
+        }
+    }
+
+    return 0;
+}
+
+int Sink_Flush(Sink_t *sink)
+{
+    struct iovec iov;
+
+    if (!Sink_Streams(sink) || sink->len == 0) {
+        return 0;
+    }
+
+    iov.iov_base = sink->buf;
+    iov.iov_len  = sink->len;
+    sink->len    = 0;
+
+    if (sink->ring) {
+        return Ring_Write(sink->ring, iov.iov_base, iov.iov_len);
+    }
+
+    return Sink_Writev(sink->fd, &iov, 1);
+}
+
+/* Make room for n more bytes, which may mean writing out what is held. Once
+ * this returns they can be written straight into buf at len */
+int Sink_Reserve(Sink_t *sink, size_t n)
+{
+    char  *buf;
+    size_t size;
+
+    if (sink->len + n <= sink->size) {
+        return 0;
+    }
+
+    if (Sink_Streams(sink) && n <= sink->size) {
+        return Sink_Flush(sink);
+    }
+
+    for (size = sink->size ? sink->size : SINK_SIZE_MIN; size < sink->len + n; size *= 2)
+        ;
+    if ((buf = realloc(sink->buf, size)) == NULL) {
+        return -ENOMEM;
+    }
+    sink->buf  = buf;
+    sink->size = size;
+
+    return 0;
+}
+
+int Sink_Write(Sink_t *sink, const void *data, size_t n)
+{
+    struct iovec iov[2];
+
+    /* Anything bigger than the buffer goes out with it in one call */
+    if (Sink_Streams(sink) && n > sink->size - sink->len && n >= sink->size / 2) {
+        if (sink->ring) {
+            return (Sink_Flush(sink) < 0) ? -EPIPE : Ring_Write(sink->ring, data, n);
+        }
+
+        iov[0].iov_base = sink->buf;
+        iov[0].iov_len  = sink->len;
+        iov[1].iov_base = (void *) data;
+        iov[1].iov_len  = n;
+        sink->len       = 0;
+
+        return Sink_Writev(sink->fd, iov, 2);
+    }
+
+    if (Sink_Reserve(sink, n) < 0) {
+        return -ENOMEM;
+    }
+    memcpy(&sink->buf[sink->len], data, n);
+    sink->len += n;
+
+    return 0;
+}
+
+int Sink_Puts(Sink_t *sink, const char *s)
+{
+    return Sink_Write(sink, s, strlen(s));
+}
+
+int Sink_Printf(Sink_t *sink, const char *fmt, ...)
+{
+    va_list ap;
+    int     n;
+
+    /* Most output fits in what is left of the buffer first time */
+    va_start(ap, fmt);
+    n = vsnprintf(&sink->buf[sink->len], sink->size - sink->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return -EINVAL;
+    }
+
+    if ((size_t) n >= sink->size - sink->len) {
+        if (Sink_Reserve(sink, n + 1) < 0) {
+            return -ENOMEM;
+        }
+        va_start(ap, fmt);
+        vsnprintf(&sink->buf[sink->len], sink->size - sink->len, fmt, ap);
+        va_end(ap);
+    }
+    sink->len += n;
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,456 @@
+//------------------------------------------------------------------------------
+//
+//  Filename:       shell_task.c
+//  Description:    Cooperative tasks for work left running in the background
+//
+//  Author:         Paul Archer
+//  Creation Date:  November, 2011
+//
+
+#define USE_DTRACE 0
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include <libraries/parser.h>
+
+#if USE_DTRACE
+#define DTRACE printf
+#else
+#define DTRACE(...)
+#endif /* USE_DTRACE */
+
+/*****************************************************************************
+ *                              T Y P E S
+ ****************************************************************************/
+typedef enum {
+    TASK_READY,
+    TASK_BLOCKED,
+    TASK_DONE,
+} Task_State_t;
+
+/* The shell itself is a task too, it has no stack of its own and is where
+ * every other task switches back to */
+typedef struct Task {
+    ucontext_t    ctx;
+    void         *stack;
+    int           id;
+    Task_State_t  state;
+    int           fd;           /* Blocked until readable, or -1 */
+    int64_t       deadline;     /* Blocked until this time, or -1 */
+    struct Task  *join;         /* Blocked until this one is done */
+    int           joiners;      /* Blocked on this one, the last frees it */
+    int           status;
+    int         (*func)(void *arg);
+    void         *arg;
+    void         *local;        /* Its state while switched out, see Task_Local */
+    struct Task  *next;
+} Task_t;
+
+#define TASK_STACK_SIZE (512*1024)
+#define TASK_SLICE_NS   1000000LL       /* Longest anyone runs before yielding */
+#define TASK_POLL_MAX   64
+
+/*****************************************************************************
+ *                 F U N C T I O N     P R O T O T Y P E S
+ ****************************************************************************/
+
+/*****************************************************************************
+ *                     G L O B A L     V A R I A B L E S
+ ****************************************************************************/
+/* Each thread that runs a shell schedules its own tasks, any other thread,
+ * such as a pipeline stage, just blocks */
+static __thread Task_t   task_main;
+static __thread Task_t  *task_list;
+static __thread int      task_ids = TASK_ID_BASE;
+static __thread int      task_held;     /* The fds are redirected, stay put */
+static __thread int64_t  task_slice;    /* When the running task next yields */
+static __thread Task_t  *task_current;
+
+static pthread_once_t    task_once = PTHREAD_ONCE_INIT;
+static void           *(*task_swap)(void *local);
+
+/****************************************************************************/
+static int64_t Task_Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void Task_AtFork(void)
+{
+    /* The tasks belong to the parent, a child only runs what it forked for,
+     * even when it was forked from one */
+    task_list          = NULL;
+    task_held          = 0;
+    task_main.state    = TASK_READY;
+    task_main.fd       = -1;
+    task_main.deadline = -1;
+    task_current       = &task_main;
+}
+
+static void Task_Once(void)
+{
+    pthread_atfork(NULL, NULL, Task_AtFork);
+}
+
+/* Make this thread a scheduler, if it is not already */
+void Task_Init(void)
+{
+    if (task_current) {
+        return;
+    }
+
+    task_main.state    = TASK_READY;
+    task_main.fd       = -1;
+    task_main.deadline = -1;
+    task_current       = &task_main;
+
+    pthread_once(&task_once, Task_Once);
+}
+
+/* Stop a task from being switched away from, while the fds it shares with
+ * every other task are redirected for it */
+void Task_Hold(void)
+{
+    task_held++;
+}
+
+void Task_Release(void)
+{
+    task_held--;
+}
+
+static bool Task_Held(void)
+{
+    return task_current == NULL || task_held > 0;
+}
+
+/* Whether blocking now would let anything else run */
+bool Task_Pending(void)
+{
+    return task_list && !Task_Held();
+}
+
+/* Whether t can go on now, and if not what it is waiting for */
+static bool Task_Ready(Task_t *t, int64_t now, int64_t *timeout,
+        struct pollfd *fds, Task_t **owners, int *nfds)
+{
+    if (t->state != TASK_BLOCKED) {
+        return t->state == TASK_READY;
+    }
+
+    if ((t->join && t->join->state == TASK_DONE) ||
+            (t->deadline >= 0 && t->deadline <= now)) {
+        t->state = TASK_READY;
+        return true;
+    }
+
+    if (t->deadline >= 0 && (*timeout < 0 || t->deadline - now < *timeout)) {
+        *timeout = t->deadline - now;
+    }
+    if (t->fd >= 0 && *nfds < TASK_POLL_MAX) {
+        fds[*nfds].fd     = t->fd;
+        fds[*nfds].events = POLLIN;
+        owners[(*nfds)++] = t;
+    }
+
+    return false;
+}
+
+/* Mark anything blocked that can now go on. With wait set this sleeps until
+ * at least one can. Returns false when nothing ever will, as everyone left is
+ * waiting on someone else */
+static bool Task_Wake(bool wait)
+{
+    struct pollfd   fds[TASK_POLL_MAX];
+    Task_t         *owners[TASK_POLL_MAX];
+    struct timespec ts;
+    Task_t         *t;
+    int64_t         now     = Task_Now();
+    int64_t         timeout = -1;
+    int             nfds    = 0;
+    bool            ready;
+    int             i;
+
+    ready = Task_Ready(&task_main, now, &timeout, fds, owners, &nfds);
+    for (t = task_list; t; t = t->next) {
+        ready |= Task_Ready(t, now, &timeout, fds, owners, &nfds);
+    }
+
+    if (nfds == 0 && timeout < 0) {
+        return ready;
+    }
+
+    if (ready || !wait) {
+        timeout = 0;
+    }
+    ts.tv_sec  = (timeout < 0) ? 0 : timeout / 1000000000LL;
+    ts.tv_nsec = (timeout < 0) ? 0 : timeout % 1000000000LL;
+
+    if (ppoll(fds, nfds, (timeout < 0) ? NULL : &ts, NULL) < 0) {
+        return true;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].revents) {
+            owners[i]->state = TASK_READY;
+        }
+    }
+
+    /* Whoever timed out is picked up on the next pass */
+    return true;
+}
+
+/* swap is called with a task's local state as it is switched in, returning
+ * whatever it replaced, and with the shell's once it is switched out again.
+ * Every task starts with NULL */
+void Task_Local(void *(*swap)(void *local))
+{
+    task_swap = swap;
+}
+
+static void Task_Switch(Task_t *t)
+{
+    void *local = task_swap ? task_swap(t->local) : NULL;
+
+    task_current = t;
+    task_slice   = Task_Now() + TASK_SLICE_NS;
+    swapcontext(&task_main.ctx, &t->ctx);
+    task_current = &task_main;
+
+    if (task_swap) {
+        t->local = task_swap(local);
+    }
+
+    if (t->state == TASK_DONE && t->stack) {
+        munmap(t->stack, TASK_STACK_SIZE);
+        t->stack = NULL;
+    }
+}
+
+/* Runs on the shell's own stack, taking turns with every task that is ready
+ * until the shell can go on */
+static void Task_Loop(void)
+{
+    Task_t *t;
+    bool    wait = false;
+    bool    ran;
+
+    for (;;) {
+        if (!Task_Wake(wait)) {
+            /* Everyone is waiting on someone else, the join will find
+             * it never finished */
+            task_main.state = TASK_READY;
+            return;
+        }
+
+        ran = false;
+        for (t = task_list; t; t = t->next) {
+            if (t->state == TASK_READY) {
+                Task_Switch(t);
+                ran = true;
+            }
+        }
+
+        if (task_main.state == TASK_READY) {
+            return;
+        }
+        wait = !ran;
+    }
+}
+
+/* Give up the processor until Task_Wake marks the current task ready */
+static void Task_Suspend(void)
+{
+    Task_t *t = task_current;
+
+    if (t == &task_main) {
+        Task_Loop();
+    } else {
+        swapcontext(&t->ctx, &task_main.ctx);
+    }
+
+    t->fd       = -1;
+    t->deadline = -1;
+    t->join     = NULL;
+}
+
+static void Task_Start(void)
+{
+    Task_t *t = task_current;
+
+    t->status = t->func(t->arg);
+    t->state  = TASK_DONE;
+
+    /* uc_link takes it back to the shell */
+}
+
+/* Returns the id of the new task, it first runs when the shell next blocks
+ * or yields. Nothing can start while the fds are redirected, -EBUSY */
+int Task_Spawn(int (*func)(void *arg), void *arg)
+{
+    Task_t *t;
+
+    if (Task_Held()) {
+        return -EBUSY;
+    }
+    if ((t = calloc(1, sizeof(*t))) == NULL) {
+        return -ENOMEM;
+    }
+
+    t->stack = mmap(NULL, TASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (t->stack == MAP_FAILED) {
+        free(t);
+        return -ENOMEM;
+    }
+
+    /* The lowest page catches anything that runs off the end */
+    mprotect(t->stack, getpagesize(), PROT_NONE);
+
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp   = t->stack;
+    t->ctx.uc_stack.ss_size = TASK_STACK_SIZE;
+    t->ctx.uc_link          = &task_main.ctx;
+    makecontext(&t->ctx, Task_Start, 0);
+
+    t->id       = ++task_ids;
+    t->state    = TASK_READY;
+    t->fd       = -1;
+    t->deadline = -1;
+    t->func     = func;
+    t->arg      = arg;
+    t->next     = task_list;
+    task_list   = t;
+
+    DTRACE("%s: %d\n", __func__, t->id);
+
+    return t->id;
+}
+
+/* Block until fd is readable, ns have passed, or both when given. Other tasks
+ * run in the meantime unless this one is being held */
+void Task_Block(int fd, int64_t ns)
+{
+    Task_t         *t = task_current;
+    struct pollfd   pfd;
+    struct timespec ts;
+
+    if (Task_Held() || (t == &task_main && task_list == NULL)) {
+        ts.tv_sec  = (ns < 0) ? 0 : ns / 1000000000LL;
+        ts.tv_nsec = (ns < 0) ? 0 : ns % 1000000000LL;
+
+        if (fd >= 0) {
+            pfd.fd     = fd;
+            pfd.events = POLLIN;
+            while (ppoll(&pfd, 1, (ns < 0) ? NULL : &ts, NULL) < 0 && errno == EINTR)
+                ;
+        } else if (ns >= 0) {
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                ;
+        }
+        return;
+    }
+
+    t->fd       = fd;
+    t->deadline = (ns < 0) ? -1 : Task_Now() + ns;
+    t->state    = TASK_BLOCKED;
+
+    Task_Suspend();
+}
+
+/* Let the others have a turn once the current one has had its slice */
+void Task_Yield(void)
+{
+    if (task_list == NULL || Task_Held() || Task_Now() < task_slice) {
+        return;
+    }
+
+    if (task_current == &task_main) {
+        Task_Loop();
+        task_slice = Task_Now() + TASK_SLICE_NS;
+    } else {
+        swapcontext(&task_current->ctx, &task_main.ctx);
+    }
+}
+
+static Task_t **Task_Find(int id)
+{
+    Task_t **p;
+
+    for (p = &task_list; *p; p = &(*p)->next) {
+        if ((*p)->id == id) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/* Wait for the task to finish and forget it. Returns its status, or -ECHILD
+ * when there is no such task */
+int Task_Join(int id)
+{
+    Task_t **p;
+    Task_t  *t;
+    int      status;
+
+    if (task_current == NULL || (p = Task_Find(id)) == NULL || *p == task_current) {
+        return -ECHILD;
+    }
+    t = *p;
+
+    if (t->state != TASK_DONE) {
+        task_current->join  = t;
+        task_current->state = TASK_BLOCKED;
+        t->joiners++;
+        Task_Suspend();
+        t->joiners--;
+
+        if (t->state != TASK_DONE) {
+            return -EDEADLK;
+        }
+    }
+
+    /* Anyone else still to wake up for it reads it too */
+    if (t->joiners > 0) {
+        return t->status;
+    }
+
+    /* Others may have come and gone while it ran */
+    p = Task_Find(id);
+    *p = t->next;
+    status = t->status;
+    free(t);
+
+    return status;
+}
+
+/* Wait for every task but the one asking */
+void Task_JoinAll(void)
+{
+    Task_t *t;
+
+    for (;;) {
+        for (t = task_list; t && t == task_current; t = t->next)
+            ;
+        if (t == NULL || Task_Join(t->id) == -EDEADLK) {
+            return;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
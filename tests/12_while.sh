@@ -1,5 +1,20 @@
 #!/bin/sh
 
+# A loop that never ran its body still succeeds
+false
+while false
+do
+    echo never
+done
+echo $?
+
+false
+for i in
+do
+    echo never
+done
+echo $?
+
 while true
 do
     echo hi
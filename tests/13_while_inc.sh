@@ -5,7 +5,7 @@ echo start while loop
 while [ $i -lt 5 ]
 do
     echo $i
-    i="7"
+    i=$((i + 1))
     sleep 1
 done
 
@@ -0,0 +1,9 @@
+#!/bin/sh
+i=0
+while [ $i -lt 5 ]
+do
+    echo $i $((i * 2)) $(( (i + 1) % 3 ))
+    i=$((i+1))
+done
+
+echo $((7 / 2)) $((-7 % 3)) $((2 < 3)) $((2 == 3)) $(( $i != 5 )) $((${i} * 0x10))
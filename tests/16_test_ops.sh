@@ -0,0 +1,31 @@
+#!/bin/sh
+a="foo"
+n="5"
+
+[ $a = foo ]
+echo $?
+[ $a != foo ]
+echo $?
+[ -z "" ]
+echo $?
+[ ! -n "" ]
+echo $?
+[ $n -ge 5 -a $n -le 5 ]
+echo $?
+[ $n -gt 9 -o $a = bar ]
+echo $?
+[ -d / ]
+echo $?
+
+if [ $n -ne 4 ]
+then
+    echo "its not four"
+fi
+
+[ $((1 / 0)) -eq 0 ]
+echo $?
+[ abc -eq 0 ]
+echo $?
+notnum=abc
+[ $notnum -ne 1 ]
+echo $?
@@ -0,0 +1,12 @@
+#!/bin/sh
+file="redirect.out"
+
+echo first > $file
+echo second >> $file
+cat $file
+cat < $file > redirect.copy
+cat redirect.copy
+cat missing.file 2>&1
+echo $?
+seq 1 3 2>&1 > $file
+cat $file
@@ -0,0 +1,9 @@
+#!/bin/sh
+seq 1 3 | cat
+echo one two | cat | cat
+seq 1 100000 | true
+echo $?
+true | false
+echo $?
+seq 5 7 |
+cat
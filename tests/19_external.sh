@@ -0,0 +1,8 @@
+#!/bin/sh
+printf "%s-%s\n" external command
+seq 1 10 | grep 7
+no_such_command
+echo $?
+hash -r
+hash printf
+echo $?
@@ -0,0 +1,13 @@
+#!/bin/sh
+sleep 1 &
+sleep 1 &
+wait
+echo both slept
+
+false &
+job=$!
+wait $job
+echo $?
+
+echo in the background &
+wait
@@ -0,0 +1,39 @@
+#!/bin/sh
+sleep 0.2 &
+i=0
+while [ $i -lt 3 ]; do
+    echo loop $i
+    sleep 0.1
+    i=$((i + 1))
+done &
+echo before the loop
+wait
+# The loop ran on a copy of i, as a subshell would
+echo after $i
+
+for x in a b; do
+    echo $x
+done &
+wait $!
+echo $?
+
+sleep 0.5s 0.1
+
+# Two waiting on the same task both get its status
+sleep 0.2 & s=$!
+for x in 1; do
+    wait $s
+    echo inner $?
+done &
+wait $s
+echo outer $?
+wait
+
+# A background loop looks commands up on its own PATH
+for i in 1; do
+    PATH=/nonexistent
+    ls /dev/null
+    echo status $?
+done &
+wait
+ls /dev/null
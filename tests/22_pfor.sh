@@ -0,0 +1,23 @@
+#!/bin/sh
+x=outer
+for -P 4 f in 1 2 3 4 5 6 7 8; do
+    sleep 0.1
+    echo item $f $x
+    x=$f
+    /bin/echo external $x
+done
+echo after $x
+
+for -P0 f in a b c; do
+    echo $f | cat
+    [ $f = c ]
+done
+echo status $?
+
+# An iteration's own PATH is the one its commands are found on
+for -P 2 f in a b; do
+    PATH=/nonexistent
+    ls /dev/null
+    echo status $?
+done
+ls /dev/null
@@ -0,0 +1,10 @@
+#!/bin/sh
+# Run from the top of the tree. Under -j each script's output is what it
+# writes run on its own, jobs and all
+./shell tests/20_jobs.sh tests/20_jobs.sh > batch.seq
+./shell -j 2 tests/20_jobs.sh tests/20_jobs.sh > batch.par
+echo $?
+cmp batch.seq batch.par
+echo $?
+cat batch.par
+rm batch.seq batch.par